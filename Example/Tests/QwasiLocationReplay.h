@@ -0,0 +1,117 @@
+//
+//  QwasiLocationReplay.h
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+
+#import "Qwasi.h"
+
+/** Stand-in for CoreLocation. Monitoring and ranging only record what was asked for, the replay
+ decides which regions are entered. */
+@interface QwasiReplayLocationManager : CLLocationManager
+
+/** Desired accuracy changes made by the SDK */
+@property (nonatomic,readonly) NSUInteger accuracyChanges;
+
+/** Regions whose state was requested and not yet answered */
+@property (nonatomic,readonly) NSArray* pendingStateRequests;
+
++ (void)setAuthorizationStatus:(CLAuthorizationStatus)status;
+
+- (void)removeAllPendingStateRequests;
+@end
+
+/** Virtual time for replays. Nothing moves until the replay advances it, then timers due on the way
+ fire in order, each at its own deadline. */
+@interface QwasiReplayClock : QwasiClock
+
+- (void)advanceBy:(NSTimeInterval)interval;
+@end
+
+/** A synthetic region enter or exit in a trace */
+@interface QwasiReplayRegionEvent : NSObject
+@property (nonatomic,readonly) CLRegionState state;
+@property (nonatomic,readonly) NSString* identifier;
+
++ (instancetype)eventWithState:(CLRegionState)state identifier:(NSString*)identifier;
+@end
+
+@interface QwasiReplayReport : NSObject
+@property (nonatomic,readonly) NSUInteger fixes;
+
+/** Trace time covered, in seconds */
+@property (nonatomic,readonly) NSTimeInterval duration;
+
+/** Emitted by the location manager, plus the Qwasi "location" event as qwasi.location */
+@property (nonatomic,readonly) NSDictionary* events;
+
+/** Calls by method, and event.post calls by event type */
+@property (nonatomic,readonly) NSDictionary* rpcs;
+@property (nonatomic,readonly) NSDictionary* eventPosts;
+
+@property (nonatomic,readonly) NSUInteger accuracyChanges;
+
+/** Thread CPU time spent delivering fixes and region callbacks */
+@property (nonatomic,readonly) NSTimeInterval cpuTime;
+@property (nonatomic,readonly) NSTimeInterval cpuPerFix;
+@end
+
+/** Replays a recorded trace through a Qwasi instance's location pipeline without a device or a
+ server. RPCs are answered locally, location.fetch a page of serverLocations at a time. The SDK's
+ dwell, trajectory and index timers run on a QwasiReplayClock that follows the trace, so they fire
+ at trace time however fast the replay goes. Must be run on the main thread. */
+@interface QwasiLocationReplay : NSObject
+
+@property (nonatomic,readonly) Qwasi* qwasi;
+@property (nonatomic,readonly) QwasiLocationManager* locationManager;
+@property (nonatomic,readonly) QwasiReplayLocationManager* standIn;
+@property (nonatomic,readonly) QwasiReplayClock* clock;
+
+/** Trace seconds per real second given to the SDK's async work between fixes, default 60 */
+@property (nonatomic,readwrite) double timeScale;
+
+/** Longest real time waited between two fixes, default 1 second */
+@property (nonatomic,readwrite) NSTimeInterval maxWait;
+
+/** Location records returned by location.fetch */
+@property (nonatomic,readwrite) NSArray* serverLocations;
+
+/** Points of tracks, routes and waypoints, a point without a time follows the last by a second */
++ (NSArray*)traceWithGPX:(NSData*)data;
+
+/** Rows of lat,lng[,unix time[,speed[,accuracy]]], or enter,<id> and exit,<id> for region events.
+ Blank lines, lines starting with # and a header row are skipped. */
++ (NSArray*)traceWithCSV:(NSString*)csv;
+
+/** Builds a registered Qwasi instance on a local client, with a location manager on the replay
+ clock that keeps its state in a temporary directory */
+- (id)initWithConfig:(QwasiConfig*)config;
+
+/** trace holds CLLocations and QwasiReplayRegionEvents */
+- (QwasiReplayReport*)replay:(NSArray*)trace;
+@end
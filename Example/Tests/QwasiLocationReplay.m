@@ -0,0 +1,697 @@
+//
+//  QwasiLocationReplay.m
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "QwasiLocationReplay.h"
+
+#import <mach/mach.h>
+
+static CLAuthorizationStatus _replayAuthorization = kCLAuthorizationStatusAuthorizedAlways;
+
+static NSTimeInterval QwasiThreadCPUTime(void) {
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    mach_port_t thread = mach_thread_self();
+    kern_return_t result = thread_info(thread, THREAD_BASIC_INFO, (thread_info_t)&info, &count);
+    
+    mach_port_deallocate(mach_task_self(), thread);
+    
+    if (result != KERN_SUCCESS) {
+        return 0;
+    }
+    
+    return info.user_time.seconds + info.user_time.microseconds / 1e6 +
+           info.system_time.seconds + info.system_time.microseconds / 1e6;
+}
+
+static void QwasiCount(NSMutableDictionary* counts, NSString* key) {
+    counts[key] = [NSNumber numberWithUnsignedInteger: [counts[key] unsignedIntegerValue] + 1];
+}
+
+#pragma mark - Virtual clock
+@interface QwasiReplayTimer : NSObject
+@property (nonatomic,assign) NSTimeInterval due;
+@property (nonatomic,strong) dispatch_queue_t queue;
+@property (nonatomic,copy) dispatch_block_t block;
+@end
+
+@implementation QwasiReplayTimer
+@end
+
+@implementation QwasiReplayClock {
+    NSTimeInterval _uptime;
+    NSDate* _start;
+    NSMutableArray* _timers;
+}
+
+- (id)init {
+    if (self = [super init]) {
+        _start = [NSDate date];
+        _timers = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (NSTimeInterval)uptime {
+    @synchronized(self) {
+        return _uptime;
+    }
+}
+
+- (NSDate*)date {
+    return [_start dateByAddingTimeInterval: self.uptime];
+}
+
+- (id)scheduleAfter:(NSTimeInterval)delay leeway:(NSTimeInterval)leeway queue:(dispatch_queue_t)queue block:(dispatch_block_t)block {
+    QwasiReplayTimer* timer = [[QwasiReplayTimer alloc] init];
+    
+    timer.queue = queue;
+    timer.block = block;
+    
+    @synchronized(self) {
+        timer.due = _uptime + MAX(delay, 0);
+        
+        [_timers addObject: timer];
+    }
+    
+    return timer;
+}
+
+- (void)cancelTimer:(id)timer {
+    @synchronized(self) {
+        [_timers removeObjectIdenticalTo: timer];
+    }
+}
+
+- (QwasiReplayTimer*)nextTimerBy:(NSTimeInterval)target {
+    @synchronized(self) {
+        QwasiReplayTimer* next = nil;
+        
+        for (QwasiReplayTimer* timer in _timers) {
+            if (timer.due <= target && (!next || timer.due < next.due)) {
+                next = timer;
+            }
+        }
+        
+        if (next) {
+            [_timers removeObjectIdenticalTo: next];
+            
+            _uptime = MAX(_uptime, next.due);
+        }
+        else {
+            _uptime = MAX(_uptime, target);
+        }
+        
+        return next;
+    }
+}
+
+- (void)advanceBy:(NSTimeInterval)interval {
+    NSTimeInterval target = self.uptime + MAX(interval, 0);
+    QwasiReplayTimer* timer;
+    
+    // a timer may schedule another inside the interval, so pick them one at a time
+    while ((timer = [self nextTimerBy: target])) {
+        if (timer.queue == dispatch_get_main_queue()) {
+            timer.block();
+        }
+        else {
+            dispatch_sync(timer.queue, timer.block);
+        }
+    }
+}
+@end
+
+#pragma mark - Stand-in location manager
+@implementation QwasiReplayLocationManager {
+    NSMutableSet* _regions;
+    NSMutableArray* _stateRequests;
+}
+
++ (CLAuthorizationStatus)authorizationStatus {
+    return _replayAuthorization;
+}
+
++ (void)setAuthorizationStatus:(CLAuthorizationStatus)status {
+    _replayAuthorization = status;
+}
+
+- (id)init {
+    if (self = [super init]) {
+        _regions = [[NSMutableSet alloc] init];
+        _stateRequests = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (NSSet*)monitoredRegions {
+    return [_regions copy];
+}
+
+- (NSArray*)pendingStateRequests {
+    return [_stateRequests copy];
+}
+
+- (void)removeAllPendingStateRequests {
+    [_stateRequests removeAllObjects];
+}
+
+- (void)setDesiredAccuracy:(CLLocationAccuracy)desiredAccuracy {
+    if (desiredAccuracy != self.desiredAccuracy) {
+        _accuracyChanges++;
+    }
+    
+    [super setDesiredAccuracy: desiredAccuracy];
+}
+
+- (void)startMonitoringForRegion:(CLRegion*)region {
+    [_regions addObject: region];
+    
+    // CoreLocation confirms asynchronously
+    dispatch_async(dispatch_get_main_queue(), ^{
+        if ([self.delegate respondsToSelector: @selector(locationManager:didStartMonitoringForRegion:)]) {
+            [self.delegate locationManager: self didStartMonitoringForRegion: region];
+        }
+    });
+}
+
+- (void)stopMonitoringForRegion:(CLRegion*)region {
+    for (CLRegion* monitored in [_regions copy]) {
+        if ([monitored.identifier isEqualToString: region.identifier]) {
+            [_regions removeObject: monitored];
+        }
+    }
+}
+
+- (void)requestStateForRegion:(CLRegion*)region {
+    [_stateRequests addObject: region];
+}
+
+- (void)startUpdatingLocation {}
+- (void)stopUpdatingLocation {}
+- (void)requestAlwaysAuthorization {}
+- (void)requestWhenInUseAuthorization {}
+- (void)allowDeferredLocationUpdatesUntilTraveled:(CLLocationDistance)distance timeout:(NSTimeInterval)timeout {}
+- (void)disallowDeferredLocationUpdates {}
+- (void)startRangingBeaconsInRegion:(CLBeaconRegion*)region {}
+- (void)stopRangingBeaconsInRegion:(CLBeaconRegion*)region {}
+@end
+
+@implementation QwasiReplayRegionEvent
+
++ (instancetype)eventWithState:(CLRegionState)state identifier:(NSString*)identifier {
+    QwasiReplayRegionEvent* event = [[QwasiReplayRegionEvent alloc] init];
+    
+    event->_state = state;
+    event->_identifier = identifier;
+    
+    return event;
+}
+@end
+
+#pragma mark - Report
+@interface QwasiReplayReport ()
+@property (nonatomic,readwrite) NSUInteger fixes;
+@property (nonatomic,readwrite) NSTimeInterval duration;
+@property (nonatomic,readwrite) NSDictionary* events;
+@property (nonatomic,readwrite) NSDictionary* rpcs;
+@property (nonatomic,readwrite) NSDictionary* eventPosts;
+@property (nonatomic,readwrite) NSUInteger accuracyChanges;
+@property (nonatomic,readwrite) NSTimeInterval cpuTime;
+@end
+
+@implementation QwasiReplayReport
+
+- (NSTimeInterval)cpuPerFix {
+    return _fixes ? _cpuTime / _fixes : 0;
+}
+
+- (NSString*)description {
+    return [NSString stringWithFormat: @"%lu fixes over %.0fs, %.1fus CPU per fix, %lu accuracy changes\nevents: %@\nrpcs: %@\nevent.post: %@",
+            (unsigned long)_fixes, _duration, self.cpuPerFix * 1e6, (unsigned long)_accuracyChanges, _events, _rpcs, _eventPosts];
+}
+@end
+
+#pragma mark - Recording client
+@interface QwasiReplayClient : QwasiClient
+@property (nonatomic,weak) QwasiLocationReplay* replay;
+@property (nonatomic,readonly) NSMutableDictionary* rpcs;
+@property (nonatomic,readonly) NSMutableDictionary* eventPosts;
+@end
+
+@implementation QwasiReplayClient
+
+- (id)initWithConfig:(QwasiConfig*)config {
+    if (self = [super initWithConfig: config]) {
+        _rpcs = [[NSMutableDictionary alloc] init];
+        _eventPosts = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void)recordMethod:(NSString*)method
+      withParameters:(id)parameters
+             success:(void (^)(AFHTTPRequestOperation*, id))success {
+    id response = @{};
+    
+    @synchronized(self) {
+        QwasiCount(_rpcs, method);
+        
+        if ([method isEqualToString: @"event.post"] && parameters[@"type"]) {
+            QwasiCount(_eventPosts, parameters[@"type"]);
+        }
+    }
+    
+    if ([method isEqualToString: @"device.register"]) {
+        response = @{ @"id": @"replay", @"channels": @[], @"application": @{ @"name": @"Replay" } };
+    }
+    else if ([method isEqualToString: @"location.fetch"]) {
+        NSArray* locations = _replay.serverLocations ?: @[];
+        NSUInteger offset = [parameters[@"options"][@"cursor"] integerValue];
+        NSUInteger size = [parameters[@"options"][@"page_size"] unsignedIntegerValue] ?: locations.count;
+        NSArray* page = [locations subarrayWithRange: NSMakeRange(MIN(offset, locations.count), MIN(size, locations.count - MIN(offset, locations.count)))];
+        id cursor = (offset + page.count < locations.count) ? [NSString stringWithFormat: @"%lu", (unsigned long)(offset + page.count)] : [NSNull null];
+        
+        response = @{ @"length": [NSNumber numberWithUnsignedInteger: page.count], @"value": page, @"cursor": cursor, @"token": @"replay" };
+    }
+    
+    // answered like a network call would be, after the caller returns
+    if (success) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            success(nil, response);
+        });
+    }
+}
+
+- (void)invokeMethod:(NSString*)method
+             success:(void (^)(AFHTTPRequestOperation*, id))success
+             failure:(void (^)(AFHTTPRequestOperation*, NSError*))failure {
+    [self recordMethod: method withParameters: nil success: success];
+}
+
+- (void)invokeMethod:(NSString*)method
+      withParameters:(id)parameters
+             success:(void (^)(AFHTTPRequestOperation*, id))success
+             failure:(void (^)(AFHTTPRequestOperation*, NSError*))failure {
+    [self recordMethod: method withParameters: parameters success: success];
+}
+
+- (void)invokeMethod:(NSString*)method
+      withParameters:(id)parameters
+           requestId:(id)requestId
+             success:(void (^)(AFHTTPRequestOperation*, id))success
+             failure:(void (^)(AFHTTPRequestOperation*, NSError*))failure {
+    [self recordMethod: method withParameters: parameters success: success];
+}
+
+- (void)invokeMethod:(NSString*)method
+      withParameters:(id)parameters
+               retry:(BOOL)retry
+             success:(void (^)(AFHTTPRequestOperation*, id))success
+             failure:(void (^)(AFHTTPRequestOperation*, NSError*))failure {
+    [self recordMethod: method withParameters: parameters success: success];
+}
+@end
+
+#pragma mark - GPX
+@interface QwasiGPXParser : NSObject<NSXMLParserDelegate>
+@property (nonatomic,readonly) NSMutableArray* trace;
+@end
+
+@implementation QwasiGPXParser {
+    NSDateFormatter* _formatter;
+    NSMutableString* _text;
+    CLLocationDegrees _lat, _lng;
+    CLLocationDistance _altitude;
+    CLLocationSpeed _speed;
+    NSDate* _time;
+    NSDate* _last;
+    BOOL _point;
+}
+
+- (id)init {
+    if (self = [super init]) {
+        _trace = [[NSMutableArray alloc] init];
+        _formatter = [[NSDateFormatter alloc] init];
+        _formatter.locale = [NSLocale localeWithLocaleIdentifier: @"en_US_POSIX"];
+    }
+    return self;
+}
+
+- (NSDate*)dateFromString:(NSString*)string {
+    for (NSString* format in @[ @"yyyy-MM-dd'T'HH:mm:ss.SSSZZZZZ", @"yyyy-MM-dd'T'HH:mm:ssZZZZZ" ]) {
+        _formatter.dateFormat = format;
+        
+        NSDate* date = [_formatter dateFromString: string];
+        
+        if (date) {
+            return date;
+        }
+    }
+    
+    return nil;
+}
+
+- (void)parser:(NSXMLParser*)parser didStartElement:(NSString*)element namespaceURI:(NSString*)uri qualifiedName:(NSString*)name attributes:(NSDictionary*)attributes {
+    
+    if ([element isEqualToString: @"trkpt"] || [element isEqualToString: @"rtept"] || [element isEqualToString: @"wpt"]) {
+        _point = YES;
+        _lat = [attributes[@"lat"] doubleValue];
+        _lng = [attributes[@"lon"] doubleValue];
+        _altitude = 0;
+        _speed = -1;
+        _time = nil;
+    }
+    
+    _text = [[NSMutableString alloc] init];
+}
+
+- (void)parser:(NSXMLParser*)parser foundCharacters:(NSString*)string {
+    [_text appendString: string];
+}
+
+- (void)parser:(NSXMLParser*)parser didEndElement:(NSString*)element namespaceURI:(NSString*)uri qualifiedName:(NSString*)name {
+    NSString* text = [_text stringByTrimmingCharactersInSet: [NSCharacterSet whitespaceAndNewlineCharacterSet]];
+    
+    if (!_point) {
+        return;
+    }
+    
+    if ([element isEqualToString: @"time"]) {
+        _time = [self dateFromString: text];
+    }
+    else if ([element isEqualToString: @"ele"]) {
+        _altitude = text.doubleValue;
+    }
+    else if ([element isEqualToString: @"speed"]) {
+        _speed = text.doubleValue;
+    }
+    else if ([element isEqualToString: @"trkpt"] || [element isEqualToString: @"rtept"] || [element isEqualToString: @"wpt"]) {
+        NSDate* time = _time ?: (_last ? [_last dateByAddingTimeInterval: 1] : [NSDate dateWithTimeIntervalSince1970: 0]);
+        
+        [_trace addObject: [[CLLocation alloc] initWithCoordinate: CLLocationCoordinate2DMake(_lat, _lng)
+                                                         altitude: _altitude
+                                               horizontalAccuracy: 10
+                                                 verticalAccuracy: -1
+                                                           course: -1
+                                                            speed: _speed
+                                                        timestamp: time]];
+        _last = time;
+        _point = NO;
+    }
+}
+@end
+
+#pragma mark - Replay
+@implementation QwasiLocationReplay {
+    QwasiReplayClient* _client;
+    NSMutableDictionary* _events;
+    NSMutableDictionary* _inside;
+}
+
++ (NSArray*)traceWithGPX:(NSData*)data {
+    NSXMLParser* parser = [[NSXMLParser alloc] initWithData: data];
+    QwasiGPXParser* gpx = [[QwasiGPXParser alloc] init];
+    
+    parser.delegate = gpx;
+    
+    return [parser parse] ? [gpx.trace copy] : nil;
+}
+
++ (NSArray*)traceWithCSV:(NSString*)csv {
+    NSMutableArray* trace = [[NSMutableArray alloc] init];
+    NSCharacterSet* whitespace = [NSCharacterSet whitespaceCharacterSet];
+    NSDate* last = nil;
+    
+    for (NSString* line in [csv componentsSeparatedByCharactersInSet: [NSCharacterSet newlineCharacterSet]]) {
+        NSMutableArray* fields = [[NSMutableArray alloc] init];
+        
+        for (NSString* field in [line componentsSeparatedByString: @","]) {
+            [fields addObject: [field stringByTrimmingCharactersInSet: whitespace]];
+        }
+        
+        NSString* first = fields[0];
+        
+        if (first.length == 0 || [first hasPrefix: @"#"]) {
+            continue;
+        }
+        
+        if (fields.count >= 2 && ([first isEqualToString: @"enter"] || [first isEqualToString: @"exit"])) {
+            CLRegionState state = [first isEqualToString: @"enter"] ? CLRegionStateInside : CLRegionStateOutside;
+            
+            [trace addObject: [QwasiReplayRegionEvent eventWithState: state identifier: fields[1]]];
+            continue;
+        }
+        
+        NSScanner* scanner = [NSScanner scannerWithString: first];
+        
+        // a header row
+        if (fields.count < 2 || ![scanner scanDouble: NULL] || !scanner.isAtEnd) {
+            continue;
+        }
+        
+        NSDate* time = (fields.count > 2 && [fields[2] length]) ? [NSDate dateWithTimeIntervalSince1970: [fields[2] doubleValue]] :
+                       (last ? [last dateByAddingTimeInterval: 1] : [NSDate dateWithTimeIntervalSince1970: 0]);
+        CLLocationSpeed speed = (fields.count > 3 && [fields[3] length]) ? [fields[3] doubleValue] : -1;
+        CLLocationAccuracy accuracy = (fields.count > 4 && [fields[4] length]) ? [fields[4] doubleValue] : 10;
+        
+        [trace addObject: [[CLLocation alloc] initWithCoordinate: CLLocationCoordinate2DMake([fields[0] doubleValue], [fields[1] doubleValue])
+                                                        altitude: 0
+                                              horizontalAccuracy: accuracy
+                                                verticalAccuracy: -1
+                                                          course: -1
+                                                           speed: speed
+                                                       timestamp: time]];
+        last = time;
+    }
+    
+    return trace;
+}
+
+- (id)initWithConfig:(QwasiConfig*)config {
+    if (self = [super init]) {
+        _timeScale = 60;
+        _maxWait = 1;
+        _events = [[NSMutableDictionary alloc] init];
+        _inside = [[NSMutableDictionary alloc] init];
+        _clock = [[QwasiReplayClock alloc] init];
+        
+        // a fresh directory per replay, so nothing the host app or an earlier replay saved is picked up
+        NSString* dir = [NSTemporaryDirectory() stringByAppendingPathComponent: [[NSUUID UUID] UUIDString]];
+        
+        [[NSFileManager defaultManager] createDirectoryAtPath: dir withIntermediateDirectories: YES attributes: nil error: nil];
+        
+        [QwasiReplayLocationManager setAuthorizationStatus: kCLAuthorizationStatusAuthorizedAlways];
+        
+        _standIn = [[QwasiReplayLocationManager alloc] init];
+        _locationManager = [[QwasiLocationManager alloc] initWithLocationManager: _standIn
+                                                           requiredAuthorization: kCLAuthorizationStatusAuthorizedAlways
+                                                                           clock: _clock
+                                                                       statePath: [dir stringByAppendingPathComponent: @"locations.json"]];
+        
+        [QwasiLocationManager setCurrentManager: _locationManager];
+        
+        _client = [[QwasiReplayClient alloc] initWithConfig: config];
+        _client.replay = self;
+        
+        _qwasi = [Qwasi qwasiWithConfig: config client: _client];
+        _qwasi.clock = _clock;
+        _qwasi.locationManager = _locationManager;
+        
+        Qwasi* qwasi = _qwasi;
+        
+        // registered through the local client like it would be against a server
+        [qwasi registerDevice: @"replay" success: nil];
+        
+        NSDate* deadline = [NSDate dateWithTimeIntervalSinceNow: 5];
+        
+        while (!qwasi.registered && [deadline timeIntervalSinceNow] > 0) {
+            [[NSRunLoop mainRunLoop] runUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.01]];
+        }
+        
+        // the listeners outlive nothing but the counts, don't let them hold the replay
+        NSMutableDictionary* events = _events;
+        
+        for (NSString* event in @[ @"location", @"enter", @"dwell", @"exit" ]) {
+            [_locationManager on: event listener: ^(id location) {
+                QwasiCount(events, event);
+            }];
+        }
+        
+        [qwasi on: @"location" listener: ^(id location) {
+            QwasiCount(events, @"qwasi.location");
+        }];
+    }
+    return self;
+}
+
+- (void)advance:(NSTimeInterval)interval {
+    NSTimeInterval wait = MIN(MAX(interval, 0) / _timeScale, _maxWait);
+    
+    // lets the SDK's async work run, such as location.fetch answers and monitoring callbacks
+    [[NSRunLoop mainRunLoop] runUntilDate: [NSDate dateWithTimeIntervalSinceNow: wait]];
+    
+    // then the trace time in between passes at once, with any timers due in it
+    [_clock advanceBy: interval];
+}
+
+- (void)updateRegionsForLocation:(CLLocation*)location {
+    id<CLLocationManagerDelegate> delegate = _standIn.delegate;
+    
+    for (CLRegion* region in _standIn.pendingStateRequests) {
+        CLRegionState state = CLRegionStateUnknown;
+        
+        if ([region isKindOfClass: [CLCircularRegion class]] && location) {
+            state = [(CLCircularRegion*)region containsCoordinate: location.coordinate] ? CLRegionStateInside : CLRegionStateOutside;
+            
+            _inside[region.identifier] = [NSNumber numberWithBool: state == CLRegionStateInside];
+        }
+        
+        [delegate locationManager: _standIn didDetermineState: state forRegion: region];
+    }
+    
+    [_standIn removeAllPendingStateRequests];
+    
+    if (!location) {
+        return;
+    }
+    
+    for (CLRegion* region in _standIn.monitoredRegions) {
+        if (![region isKindOfClass: [CLCircularRegion class]]) {
+            continue;
+        }
+        
+        BOOL inside = [(CLCircularRegion*)region containsCoordinate: location.coordinate];
+        
+        if (inside != [_inside[region.identifier] boolValue]) {
+            _inside[region.identifier] = [NSNumber numberWithBool: inside];
+            
+            if (inside) {
+                [delegate locationManager: _standIn didEnterRegion: region];
+            }
+            else {
+                [delegate locationManager: _standIn didExitRegion: region];
+            }
+        }
+    }
+}
+
+- (void)applyRegionEvent:(QwasiReplayRegionEvent*)event {
+    for (CLRegion* region in _standIn.monitoredRegions) {
+        if ([region.identifier isEqualToString: event.identifier]) {
+            _inside[region.identifier] = [NSNumber numberWithBool: event.state == CLRegionStateInside];
+            
+            if (event.state == CLRegionStateInside) {
+                [_standIn.delegate locationManager: _standIn didEnterRegion: region];
+            }
+            else {
+                [_standIn.delegate locationManager: _standIn didExitRegion: region];
+            }
+        }
+    }
+}
+
+- (QwasiReplayReport*)replay:(NSArray*)trace {
+    QwasiReplayReport* report = [[QwasiReplayReport alloc] init];
+    NSDate* base = _clock.date;
+    NSDate* start = nil;
+    NSTimeInterval previous = 0;
+    NSTimeInterval cpu = 0;
+    NSUInteger accuracyChanges = _standIn.accuracyChanges;
+    
+    [_events removeAllObjects];
+    
+    @synchronized(_client) {
+        [_client.rpcs removeAllObjects];
+        [_client.eventPosts removeAllObjects];
+    }
+    
+    _qwasi.locationEnabled = YES;
+    
+    [_locationManager locationManager: _standIn didChangeAuthorizationStatus: kCLAuthorizationStatusAuthorizedAlways];
+    
+    for (id item in trace) {
+        NSTimeInterval begin;
+        
+        if ([item isKindOfClass: [QwasiReplayRegionEvent class]]) {
+            begin = QwasiThreadCPUTime();
+            
+            [self applyRegionEvent: item];
+            
+            cpu += QwasiThreadCPUTime() - begin;
+            continue;
+        }
+        
+        CLLocation* recorded = item;
+        
+        if (!start) {
+            start = recorded.timestamp;
+        }
+        
+        NSTimeInterval offset = [recorded.timestamp timeIntervalSinceDate: start];
+        
+        [self advance: offset - previous];
+        
+        previous = offset;
+        
+        // rebased onto the replay clock so the SDK's age checks see a live fix
+        CLLocation* fix = [[CLLocation alloc] initWithCoordinate: recorded.coordinate
+                                                        altitude: recorded.altitude
+                                              horizontalAccuracy: recorded.horizontalAccuracy
+                                                verticalAccuracy: recorded.verticalAccuracy
+                                                          course: recorded.course
+                                                           speed: recorded.speed
+                                                       timestamp: [base dateByAddingTimeInterval: offset]];
+        
+        begin = QwasiThreadCPUTime();
+        
+        [_locationManager locationManager: _standIn didUpdateLocations: @[ fix ]];
+        
+        [self updateRegionsForLocation: fix];
+        
+        cpu += QwasiThreadCPUTime() - begin;
+        
+        report.fixes++;
+    }
+    
+    // answer anything the last fixes kicked off
+    [self advance: _maxWait * _timeScale];
+    [self updateRegionsForLocation: nil];
+    
+    report.duration = previous;
+    report.cpuTime = cpu;
+    report.accuracyChanges = _standIn.accuracyChanges - accuracyChanges;
+    report.events = [_events copy];
+    
+    @synchronized(_client) {
+        report.rpcs = [_client.rpcs copy];
+        report.eventPosts = [_client.eventPosts copy];
+    }
+    
+    return report;
+}
+@end
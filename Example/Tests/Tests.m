@@ -11,6 +11,11 @@
 #import "Specta.h"
 #import "Expecta.h"
 #import "Qwasi.h"
+#import <CommonCrypto/CommonDigest.h>
+#import "QwasiTrajectory.h"
+#import "QwasiProximity.h"
+#import "QwasiLocationReplay.h"
+#import "QwasiLocationIndex.h"
 
 NSString* _deviceToken;
 
@@ -57,4 +62,673 @@ describe(@"Test Qwasi API Client", ^{
     });
 });
 
+describe(@"Test QwasiMessage payload decoding", ^{
+    
+    QwasiMessage* (^octetMessage)(NSString*, NSString*) = ^QwasiMessage*(NSString* payload, NSString* sha) {
+        NSMutableDictionary* data = [@{ @"id": @"56a7d4f1e4b0a1b2c3d4e5fb",
+                                        @"application": @"552f5e6e3e73ca104b46191d",
+                                        @"text": @"Octets",
+                                        @"created_at": @"2016-01-01T00:00:00.000Z",
+                                        @"payload_type": @"application/octet-stream",
+                                        @"payload": payload } mutableCopy];
+        
+        if (sha) {
+            data[@"payload_sha"] = sha;
+        }
+        
+        return [QwasiMessage messageWithData: data];
+    };
+    
+    it(@"Will decode base64 like NSData for every padding length", ^{
+        
+        // 3, 4 and 5 bytes encode with no, two and one '='
+        for (NSUInteger length = 3; length <= 5; length++) {
+            NSData* bytes = [@"Qwasi" dataUsingEncoding: NSUTF8StringEncoding];
+            NSString* padded = [[bytes subdataWithRange: NSMakeRange(0, length)] base64EncodedStringWithOptions: 0];
+            NSString* unpadded = [padded stringByReplacingOccurrencesOfString: @"=" withString: @""];
+            NSData* expected = [[NSData alloc] initWithBase64EncodedString: padded options: 0];
+            
+            expect(octetMessage(padded, nil).rawPayload).to.equal(expected);
+            expect(octetMessage(unpadded, nil).rawPayload).to.equal(expected);
+        }
+        
+        // '=' can't end a short quantum
+        expect([[NSData alloc] initWithBase64EncodedString: @"AA=" options: 0]).to.beNil();
+        expect(octetMessage(@"AA=", nil).rawPayload).to.beNil();
+        expect(octetMessage(@"AAA==", nil).rawPayload).to.beNil();
+    });
+    
+    it(@"Will check the payload against payload_sha", ^{
+        NSData* bytes = [@"Qwasi payload digest" dataUsingEncoding: NSUTF8StringEncoding];
+        unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+        NSMutableString* sha = [[NSMutableString alloc] init];
+        
+        CC_SHA1(bytes.bytes, (CC_LONG)bytes.length, digest);
+        
+        for (int i = 0; i < CC_SHA1_DIGEST_LENGTH; i++) {
+            [sha appendFormat: @"%02x", digest[i]];
+        }
+        
+        NSString* encoded = [bytes base64EncodedStringWithOptions: 0];
+        NSString* mismatched = [([sha hasPrefix: @"0"] ? @"f" : @"0") stringByAppendingString: [sha substringFromIndex: 1]];
+        
+        expect(octetMessage(encoded, sha).rawPayload).to.equal(bytes);
+        expect(octetMessage(encoded, [sha uppercaseString]).rawPayload).to.equal(bytes);
+        expect(octetMessage(encoded, mismatched).rawPayload).to.beNil();
+    });
+    
+    it(@"Will inflate gzip encoded payloads", ^{
+        NSMutableArray* products = [[NSMutableArray alloc] init];
+        
+        for (int i = 0; i < 500; i++) {
+            [products addObject: @{ @"sku": [NSString stringWithFormat: @"SKU-%05d", i], @"name": @"Catalog item", @"price": @(i * 1.25) }];
+        }
+        
+        NSData* json = [NSJSONSerialization dataWithJSONObject: @{ @"products": products } options: 0 error: nil];
+        NSData* gzip = [QwasiMessage compressPayloadData: json];
+        
+        QwasiMessage* message = [QwasiMessage messageWithData: @{ @"id": @"56a7d4f1e4b0a1b2c3d4e5f8",
+                                                                  @"application": @"552f5e6e3e73ca104b46191d",
+                                                                  @"text": @"Catalog",
+                                                                  @"created_at": @"2016-01-01T00:00:00.000Z",
+                                                                  @"payload_type": @"application/json",
+                                                                  @"payload_encoding": @"gzip",
+                                                                  @"payload": [gzip base64EncodedStringWithOptions: 0] }];
+        
+        expect(gzip.length * 4).to.beLessThan(json.length);
+        expect([QwasiMessage inflatePayloadData: gzip]).to.equal(json);
+        expect(message.rawPayload).to.equal(gzip);
+        expect(message.payload[@"products"]).to.haveCountOf(500);
+        expect([QwasiMessage messageWithArchive: [message archive] updateFlags: NO].payloadEncoding).to.equal(@"gzip");
+    });
+    
+    it(@"Will refuse payloads that inflate past the limit", ^{
+        NSData* zeros = [[NSMutableData alloc] initWithLength: 4 * 1024 * 1024];
+        NSData* bomb = [QwasiMessage compressPayloadData: zeros];
+        
+        expect(bomb.length).to.beLessThan(16 * 1024);
+        expect([QwasiMessage inflatePayloadData: bomb maxLength: zeros.length]).to.equal(zeros);
+        expect([QwasiMessage inflatePayloadData: bomb maxLength: zeros.length - 1]).to.beNil();
+        expect([QwasiMessage inflatePayloadData: bomb maxLength: 64 * 1024]).to.beNil();
+    });
+    
+    NSDictionary* (^multiImageMessage)(NSUInteger) = ^NSDictionary*(NSUInteger count) {
+        NSMutableArray* parts = [[NSMutableArray alloc] init];
+        
+        for (NSUInteger i = 0; i < count; i++) {
+            UIGraphicsBeginImageContextWithOptions(CGSizeMake(1024, 1024), YES, 1.0);
+            
+            for (int j = 0; j < 64; j++) {
+                [[UIColor colorWithHue: arc4random_uniform(256) / 255.0 saturation: 1.0 brightness: 1.0 alpha: 1.0] setFill];
+                UIRectFill(CGRectMake(arc4random_uniform(1024), arc4random_uniform(1024), 128, 128));
+            }
+            
+            NSData* png = UIImagePNGRepresentation(UIGraphicsGetImageFromCurrentImageContext());
+            
+            UIGraphicsEndImageContext();
+            
+            [parts addObject: @{ @"payload_type": @"image/png",
+                                 @"payload": [png base64EncodedStringWithOptions: 0] }];
+        }
+        
+        NSData* aim = [NSJSONSerialization dataWithJSONObject: parts options: 0 error: nil];
+        
+        return @{ @"id": @"56a7d4f1e4b0a1b2c3d4e5fa",
+                  @"text": @"Multi-image message",
+                  @"created_at": @"2016-01-01T00:00:00.000Z",
+                  @"payload_type": @"application/vnd.qwasi.aim+json",
+                  @"payload": [aim base64EncodedStringWithOptions: 0] };
+    };
+    
+    it(@"Will decode multi-image messages the same serially and in parallel", ^{
+        NSUInteger count = 8;
+        NSDictionary* data = multiImageMessage(count);
+        NSUInteger threshold = [QwasiMessage parallelDecodeThreshold];
+        
+        [QwasiMessage setParallelDecodeThreshold: NSUIntegerMax];
+        
+        NSArray* serial = [QwasiMessage messageWithData: data].payload;
+        
+        [QwasiMessage setParallelDecodeThreshold: 0];
+        
+        NSArray* parallel = [QwasiMessage messageWithData: data].payload;
+        
+        [QwasiMessage setParallelDecodeThreshold: threshold];
+        
+        expect(serial.count).to.equal(count);
+        expect(parallel.count).to.equal(count);
+        
+        // parts come back in order whichever way they were decoded
+        for (NSUInteger i = 0; i < count; i++) {
+            expect(serial[i]).to.beKindOf([UIImage class]);
+            expect(parallel[i]).to.beKindOf([UIImage class]);
+            expect(UIImagePNGRepresentation(parallel[i])).to.equal(UIImagePNGRepresentation(serial[i]));
+        }
+    });
+    
+    describe(@"benchmark", ^{
+        __block NSDictionary* data;
+        __block NSUInteger threshold;
+        
+        beforeAll(^{
+            data = multiImageMessage(8);
+            threshold = [QwasiMessage parallelDecodeThreshold];
+        });
+        
+        afterEach(^{
+            [QwasiMessage setParallelDecodeThreshold: threshold];
+        });
+        
+        // parts are decoded without a cache key, so every pass decodes all eight images again
+        it(@"decodes a multi-image message serially", ^{
+            [QwasiMessage setParallelDecodeThreshold: NSUIntegerMax];
+            
+            [(XCTestCase*)SPTCurrentSpec measureBlock: ^{
+                expect([QwasiMessage messageWithData: data].payload).to.haveCountOf(8);
+            }];
+        });
+        
+        it(@"decodes a multi-image message in parallel", ^{
+            [QwasiMessage setParallelDecodeThreshold: 0];
+            
+            [(XCTestCase*)SPTCurrentSpec measureBlock: ^{
+                expect([QwasiMessage messageWithData: data].payload).to.haveCountOf(8);
+            }];
+        });
+    });
+});
+
+describe(@"Test QwasiMessage archiving", ^{
+    
+    NSMutableDictionary* json = [[NSMutableDictionary alloc] init];
+    
+    for (int i = 0; i < 32; i++) {
+        json[[NSString stringWithFormat: @"key%d", i]] = [NSString stringWithFormat: @"value %d", i];
+    }
+    
+    QwasiMessage* (^archivedMessage)(void) = ^QwasiMessage*(void) {
+        NSData* payload = [NSJSONSerialization dataWithJSONObject: json options: 0 error: nil];
+        
+        return [QwasiMessage messageWithData: @{ @"id": @"56a7d4f1e4b0a1b2c3d4e5f6",
+                                                 @"application": @"552f5e6e3e73ca104b46191d",
+                                                 @"text": @"Archived message",
+                                                 @"created_at": @"2016-01-01T00:00:00.000Z",
+                                                 @"payload_type": @"application/json",
+                                                 @"payload": [payload base64EncodedStringWithOptions: 0],
+                                                 @"tags": @[ @"promo", @"archive" ] }];
+    };
+    
+    it(@"Will archive smaller than NSKeyedArchiver", ^{
+        QwasiMessage* message = archivedMessage();
+        
+        NSData* keyed = [NSKeyedArchiver archivedDataWithRootObject: message];
+        NSData* binary = [message archive];
+        
+        QwasiMessage* restored = [QwasiMessage messageWithArchive: binary updateFlags: NO];
+        
+        expect(binary.length).to.beLessThan(keyed.length);
+        expect(restored.messageId).to.equal(message.messageId);
+        expect(restored.alert).to.equal(message.alert);
+        expect(restored.timestamp).to.equal(message.timestamp);
+        expect(restored.tags).to.equal(message.tags);
+        expect(restored.payload).to.equal(json);
+        expect([QwasiMessage messageWithArchive: keyed updateFlags: NO].payload).to.equal(json);
+    });
+    
+    it(@"Will reject truncated and unknown version archives", ^{
+        QwasiMessage* message = [QwasiMessage messageWithData: @{ @"id": @"56a7d4f1e4b0a1b2c3d4e5f9",
+                                                                  @"application": @"552f5e6e3e73ca104b46191d",
+                                                                  @"text": @"Archived message",
+                                                                  @"created_at": @"2016-01-01T00:00:00.000Z" }];
+        
+        NSData* binary = [message archive];
+        NSMutableData* future = [binary mutableCopy];
+        
+        ((uint8_t*)future.mutableBytes)[3] = 0xff;
+        
+        expect([QwasiMessage messageWithArchive: [binary subdataWithRange: NSMakeRange(0, 3)] updateFlags: NO]).to.beNil();
+        expect([QwasiMessage messageWithArchive: [binary subdataWithRange: NSMakeRange(0, binary.length - 1)] updateFlags: NO]).to.beNil();
+        expect([QwasiMessage messageWithArchive: future updateFlags: NO]).to.beNil();
+    });
+    
+    describe(@"benchmark", ^{
+        // a message store load or save touches hundreds of archives, time a batch rather than one
+        NSUInteger batch = 1000;
+        __block QwasiMessage* message;
+        
+        beforeAll(^{
+            message = archivedMessage();
+        });
+        
+        it(@"encodes with the binary archive", ^{
+            [(XCTestCase*)SPTCurrentSpec measureBlock: ^{
+                for (NSUInteger i = 0; i < batch; i++) {
+                    expect([message archive]).notTo.beNil();
+                }
+            }];
+        });
+        
+        it(@"encodes with NSKeyedArchiver", ^{
+            [(XCTestCase*)SPTCurrentSpec measureBlock: ^{
+                for (NSUInteger i = 0; i < batch; i++) {
+                    expect([NSKeyedArchiver archivedDataWithRootObject: message]).notTo.beNil();
+                }
+            }];
+        });
+        
+        it(@"decodes the binary archive", ^{
+            NSData* binary = [message archive];
+            
+            [(XCTestCase*)SPTCurrentSpec measureBlock: ^{
+                for (NSUInteger i = 0; i < batch; i++) {
+                    expect([QwasiMessage messageWithArchive: binary updateFlags: NO]).notTo.beNil();
+                }
+            }];
+        });
+        
+        it(@"decodes NSKeyedArchiver archives", ^{
+            NSData* keyed = [NSKeyedArchiver archivedDataWithRootObject: message];
+            
+            [(XCTestCase*)SPTCurrentSpec measureBlock: ^{
+                for (NSUInteger i = 0; i < batch; i++) {
+                    expect([QwasiMessage messageWithArchive: keyed updateFlags: NO]).notTo.beNil();
+                }
+            }];
+        });
+    });
+});
+
+describe(@"Test QwasiMessageIndex", ^{
+    
+    it(@"delivers a message once", ^{
+        NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"messages-test.idx"];
+        
+        [[NSFileManager defaultManager] removeItemAtPath: path error: nil];
+        
+        QwasiMessageIndex* index = [[QwasiMessageIndex alloc] initWithPath: path capacity: 4];
+        QwasiMessage* message = [QwasiMessage messageWithData: @{ @"id": @"56a7d4f1e4b0a1b2c3d4e5f7",
+                                                                  @"application": @"552f5e6e3e73ca104b46191d",
+                                                                  @"text": @"Duplicate message",
+                                                                  @"created_at": @"2016-01-01T00:00:00.000Z" }];
+        
+        expect([index containsMessageId: message.messageId]).to.beFalsy();
+        expect([index markDelivered: message]).to.beTruthy();
+        expect([index markDelivered: message]).to.beFalsy();
+        expect([index containsMessageId: message.messageId]).to.beTruthy();
+        
+        // the save is queued behind the delivery, a fresh instance sees it
+        QwasiMessageIndex* reloaded = [[QwasiMessageIndex alloc] initWithPath: path capacity: 4];
+        
+        expect([reloaded markDelivered: message]).to.beFalsy();
+        
+        [index removeAllMessageIds];
+        
+        expect([index markDelivered: message]).to.beTruthy();
+    });
+});
+
+describe(@"Test QwasiMessageStore", ^{
+    
+    it(@"keeps only the newest messages", ^{
+        NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"messages-test.sqlite"];
+        
+        for (NSString* suffix in @[ @"", @"-wal", @"-shm" ]) {
+            [[NSFileManager defaultManager] removeItemAtPath: [path stringByAppendingString: suffix] error: nil];
+        }
+        
+        QwasiMessageStore* store = [[QwasiMessageStore alloc] initWithPath: path];
+        
+        store.maxMessageCount = 3;
+        
+        for (int i = 0; i < 5; i++) {
+            [store storeMessage: [QwasiMessage messageWithData: @{ @"id": [NSString stringWithFormat: @"56a7d4f1e4b0a1b2c3d4e60%d", i],
+                                                                    @"application": @"552f5e6e3e73ca104b46191d",
+                                                                    @"text": @"Stored message",
+                                                                    @"created_at": [NSString stringWithFormat: @"2016-01-0%dT00:00:00.000Z", i + 1] }]];
+        }
+        
+        NSArray* kept = [store messagesBefore: nil limit: 10];
+        
+        expect(kept).to.haveCountOf(3);
+        expect([kept.firstObject messageId]).to.equal(@"56a7d4f1e4b0a1b2c3d4e604");
+        expect([kept.lastObject messageId]).to.equal(@"56a7d4f1e4b0a1b2c3d4e602");
+        expect([store containsMessage: @"56a7d4f1e4b0a1b2c3d4e600"]).to.beFalsy();
+        
+        // everything here is from 2016
+        store.maxMessageAge = 30 * 24 * 60 * 60;
+        
+        [store pruneMessages];
+        
+        expect([store messagesBefore: nil limit: 10]).to.haveCountOf(0);
+        expect([store containsMessage: @"56a7d4f1e4b0a1b2c3d4e604"]).to.beFalsy();
+    });
+    
+    it(@"keeps the read mark when a message is stored again", ^{
+        NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"messages-read-test.sqlite"];
+        
+        for (NSString* suffix in @[ @"", @"-wal", @"-shm" ]) {
+            [[NSFileManager defaultManager] removeItemAtPath: [path stringByAppendingString: suffix] error: nil];
+        }
+        
+        QwasiMessageStore* store = [[QwasiMessageStore alloc] initWithPath: path];
+        NSDictionary* data = @{ @"id": @"56a7d4f1e4b0a1b2c3d4e610",
+                                @"application": @"552f5e6e3e73ca104b46191d",
+                                @"text": @"Stored message",
+                                @"created_at": @"2016-01-01T00:00:00.000Z" };
+        
+        [store storeMessage: [QwasiMessage messageWithData: data]];
+        [store markMessage: data[@"id"] read: YES];
+        [store storeMessage: [QwasiMessage messageWithData: data]];
+        
+        expect([store unreadMessagesBefore: nil limit: 10]).to.haveCountOf(0);
+        expect([store messagesBefore: nil limit: 10]).to.haveCountOf(1);
+    });
+});
+
+describe(@"Test QwasiTrajectory", ^{
+    
+    it(@"simplifies a straight run down to its corners", ^{
+        QwasiTrajectory* trajectory = [[QwasiTrajectory alloc] initWithTolerance: 5];
+        NSDate* start = [NSDate dateWithTimeIntervalSince1970: 1451606400];
+        
+        // ten fixes heading north, then ten heading east
+        for (int i = 0; i <= 20; i++) {
+            CLLocationCoordinate2D coordinate = CLLocationCoordinate2DMake(40.0 + MIN(i, 10) * 0.001, -75.0 + MAX(i - 10, 0) * 0.001);
+            
+            [trajectory addLocation: [[CLLocation alloc] initWithCoordinate: coordinate
+                                                                   altitude: 0
+                                                         horizontalAccuracy: 5
+                                                           verticalAccuracy: -1
+                                                                  timestamp: [start dateByAddingTimeInterval: i * 10]]];
+        }
+        
+        NSArray* simplified = [trajectory simplifiedLocations];
+        
+        expect(simplified.count).to.equal(3);
+        expect([simplified[1] coordinate].latitude).to.beCloseToWithin(40.01, 1e-9);
+        expect(trajectory.duration).to.equal(200);
+        
+        NSDictionary* segment = [trajectory encodedSegment];
+        NSDictionary* path = segment[@"path"];
+        
+        expect([segment[@"lat"] doubleValue]).to.beCloseToWithin(40.01, 1e-9);
+        expect([segment[@"lng"] doubleValue]).to.beCloseToWithin(-74.99, 1e-9);
+        expect(path[@"lat"]).to.equal(@40.0);
+        expect(path[@"dlat"]).to.equal(@[ @100000, @0 ]);
+        expect(path[@"dlng"]).to.equal(@[ @0, @100000 ]);
+        expect(path[@"dtime"]).to.equal(@[ @100000, @100000 ]);
+        expect(path[@"fixes"]).to.equal(@21);
+    });
+});
+
+describe(@"Test QwasiProximity", ^{
+    
+    NSUInteger count = 5000;
+    CLLocation* origin = [[CLLocation alloc] initWithLatitude: 40.7128 longitude: -74.0060];
+    NSMutableArray* points = [[NSMutableArray alloc] initWithCapacity: count];
+    
+    srand48(42);
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        [points addObject: [[CLLocation alloc] initWithLatitude: origin.coordinate.latitude + (drand48() - 0.5)
+                                                      longitude: origin.coordinate.longitude + (drand48() - 0.5)]];
+    }
+    
+    it(@"matches CLLocation distances on thousands of points", ^{
+        QwasiProximity* proximity = [[QwasiProximity alloc] initWithLocations: points];
+        double* distances = malloc(count * sizeof(double));
+        double* expected = malloc(count * sizeof(double));
+        
+        [proximity distancesFrom: origin into: distances];
+        
+        for (NSUInteger i = 0; i < count; i++) {
+            expected[i] = [origin distanceFromLocation: points[i]];
+        }
+        
+        NSUInteger nearest = 0;
+        
+        for (NSUInteger i = 0; i < count; i++) {
+            expect(distances[i]).to.beCloseToWithin(expected[i], MAX(expected[i] * 0.005, 0.5));
+            
+            if (expected[i] < expected[nearest]) {
+                nearest = i;
+            }
+        }
+        
+        CLLocationDistance distance;
+        
+        expect([proximity nearestEdgeTo: origin distance: &distance]).to.equal(nearest);
+        expect(distance).to.beCloseToWithin(expected[nearest], MAX(expected[nearest] * 0.005, 0.5));
+        
+        free(distances);
+        free(expected);
+    });
+    
+    it(@"measures geofences from their edge", ^{
+        QwasiLocation* geofence = [[QwasiLocation alloc] initWithLocationData: @{ @"id": @"56a7d4f1e4b0a1b2c3d4e5f8",
+                                                                                 @"name": @"Office",
+                                                                                 @"geofence": @{ @"geometry": @{ @"type": @"Point",
+                                                                                                                 @"coordinates": @[ @(-74.0060), @40.7128 ] },
+                                                                                                  @"properties": @{ @"radius": @100 } } }];
+        QwasiProximity* proximity = [[QwasiProximity alloc] initWithLocations: @[ geofence ]];
+        CLLocation* outside = [[CLLocation alloc] initWithLatitude: 40.7128 + 0.0045 longitude: -74.0060];
+        CLLocationDistance distance;
+        
+        expect([proximity nearestEdgeTo: outside distance: &distance]).to.equal(0);
+        expect(distance).to.beCloseToWithin([outside distanceFromLocation: geofence] - 100, 3);
+        
+        [proximity edgeDistancesFrom: geofence into: &distance];
+        
+        expect(distance).to.equal(0);
+        expect([[[QwasiProximity alloc] initWithLocations: @[]] nearestEdgeTo: outside distance: nil]).to.equal(NSNotFound);
+    });
+    
+    describe(@"benchmark", ^{
+        // a single pass over 5000 points is too quick to time reliably, repeat it as a location update burst would
+        NSUInteger passes = 100;
+        
+        it(@"finds the nearest point with the proximity kernel", ^{
+            QwasiProximity* proximity = [[QwasiProximity alloc] initWithLocations: points];
+            
+            [(XCTestCase*)SPTCurrentSpec measureBlock: ^{
+                for (NSUInteger pass = 0; pass < passes; pass++) {
+                    expect([proximity nearestEdgeTo: origin distance: nil]).notTo.equal(NSNotFound);
+                }
+            }];
+        });
+        
+        it(@"finds the nearest point with CLLocation", ^{
+            [(XCTestCase*)SPTCurrentSpec measureBlock: ^{
+                for (NSUInteger pass = 0; pass < passes; pass++) {
+                    NSUInteger nearest = NSNotFound;
+                    CLLocationDistance best = DBL_MAX;
+                    
+                    for (NSUInteger i = 0; i < count; i++) {
+                        CLLocationDistance distance = [origin distanceFromLocation: points[i]];
+                        
+                        if (distance < best) {
+                            best = distance;
+                            nearest = i;
+                        }
+                    }
+                    
+                    expect(nearest).notTo.equal(NSNotFound);
+                }
+            }];
+        });
+    });
+});
+
+describe(@"Test QwasiBeaconRanger", ^{
+    
+    QwasiLocation* (^beaconLocation)(void) = ^QwasiLocation*(void) {
+        return [[QwasiLocation alloc] initWithLocationData: @{ @"id": @"56a7d4f1e4b0a1b2c3d4e5f9",
+                                                               @"name": @"Entrance",
+                                                               @"beacon": @{ @"type": @"ibeacon",
+                                                                             @"id": @[ @"B9407F30-F5F8-466E-AFF9-25556B57FE6D", @1, @2 ],
+                                                                             @"proximity": @2 } }];
+    };
+    
+    it(@"ignores a single noisy reading", ^{
+        QwasiBeaconRanger* ranger = [[QwasiBeaconRanger alloc] init];
+        QwasiLocation* location = beaconLocation();
+        
+        expect([ranger updateLocation: location distance: 1.0 at: 0]).to.equal(QwasiBeaconDecisionNone);
+        expect([ranger updateLocation: location distance: 1.2 at: 1]).to.equal(QwasiBeaconDecisionEnter);
+        
+        // one spike and one dropout are not an exit
+        expect([ranger updateLocation: location distance: 12.0 at: 2]).to.equal(QwasiBeaconDecisionNone);
+        expect([ranger updateLocation: location distance: -1 at: 3]).to.equal(QwasiBeaconDecisionNone);
+        expect([ranger updateLocation: location distance: 1.1 at: 4]).to.equal(QwasiBeaconDecisionNone);
+        expect([ranger distanceForLocation: location]).to.beLessThan(location.beaconProximity * ranger.exitFactor);
+        
+        QwasiBeaconDecision decision = QwasiBeaconDecisionNone;
+        
+        for (int i = 0; i < 5; i++) {
+            decision = [ranger updateLocation: location distance: -1 at: 5 + i];
+        }
+        
+        expect(decision).to.equal(QwasiBeaconDecisionExit);
+    });
+    
+    it(@"lets ranging rest once settled", ^{
+        QwasiBeaconRanger* ranger = [[QwasiBeaconRanger alloc] init];
+        QwasiLocation* location = beaconLocation();
+        
+        for (int i = 0; i < 12; i++) {
+            [ranger updateLocation: location distance: 0.5 at: i];
+        }
+        
+        expect([ranger isStableLocation: location]).to.beTruthy();
+        
+        [ranger resumeLocation: location];
+        
+        expect([ranger isStableLocation: location]).to.beFalsy();
+        
+        [ranger removeLocation: location];
+        
+        expect([ranger distanceForLocation: location]).to.equal(-1);
+    });
+});
+
+describe(@"Test QwasiLocationReplay", ^{
+    
+    it(@"reads GPX and CSV traces", ^{
+        NSString* gpx = @"<gpx><trk><trkseg>"
+                         "<trkpt lat=\"40.7000\" lon=\"-74.0000\"><time>2016-01-01T12:00:00Z</time></trkpt>"
+                         "<trkpt lat=\"40.7001\" lon=\"-74.0000\"><time>2016-01-01T12:00:05Z</time></trkpt>"
+                         "</trkseg></trk></gpx>";
+        NSArray* trace = [QwasiLocationReplay traceWithGPX: [gpx dataUsingEncoding: NSUTF8StringEncoding]];
+        
+        expect(trace.count).to.equal(2);
+        expect([[trace[1] timestamp] timeIntervalSinceDate: [trace[0] timestamp]]).to.equal(5);
+        
+        trace = [QwasiLocationReplay traceWithCSV: @"lat,lng,time\n40.7,-74.0,1451649600\n\n# comment\nenter,office\n40.7001,-74.0\n"];
+        
+        expect(trace.count).to.equal(3);
+        expect(trace[1]).to.beKindOf([QwasiReplayRegionEvent class]);
+        expect([[trace[2] timestamp] timeIntervalSince1970]).to.equal(1451649601);
+    });
+    
+    it(@"replays a walk past a geofence", ^{
+        QwasiLocationReplay* replay = [[QwasiLocationReplay alloc] initWithConfig: [QwasiConfig configWithURL: [NSURL URLWithString: @"https://replay.invalid"]
+                                                                                              withApplication: @"552f5e6e3e73ca104b46191d"
+                                                                                                      withKey: @"replay"]];
+        NSMutableString* csv = [[NSMutableString alloc] initWithString: @"lat,lng,time,speed\n"];
+        
+        // about 1.1km north at walking pace, a fix every 5 seconds
+        for (int i = 0; i <= 160; i++) {
+            [csv appendFormat: @"%.6f,-74.000000,%d,1.4\n", 40.7 + i * 0.0000625, 1451649600 + i * 5];
+        }
+        
+        expect(replay.qwasi.registered).to.beTruthy();
+        
+        replay.timeScale = 600;
+        replay.serverLocations = @[ @{ @"id": @"56a7d4f1e4b0a1b2c3d4e5fa",
+                                       @"name": @"Office",
+                                       @"geofence": @{ @"geometry": @{ @"type": @"Point",
+                                                                       @"coordinates": @[ @(-74.0), @40.706 ] },
+                                                       @"properties": @{ @"radius": @50 } } } ];
+        
+        QwasiReplayReport* report = [replay replay: [QwasiLocationReplay traceWithCSV: csv]];
+        
+        expect(report.fixes).to.equal(161);
+        expect(report.duration).to.equal(800);
+        expect(report.events[@"location"]).to.equal(161);
+        expect(report.events[@"enter"]).to.equal(1);
+        
+        // about a minute inside, dwell checks run on the replay clock
+        expect([report.events[@"dwell"] unsignedIntegerValue]).to.beGreaterThan(0);
+        expect(report.events[@"exit"]).to.equal(1);
+        expect([report.rpcs[@"location.fetch"] unsignedIntegerValue]).to.beGreaterThan(0);
+        expect(report.eventPosts[@"com.qwasi.event.location.enter"]).to.equal(1);
+        expect([report.eventPosts[@"com.qwasi.event.location.update"] unsignedIntegerValue]).to.beInTheRangeOf(1, 10);
+        expect(report.cpuPerFix).to.beGreaterThan(0);
+    });
+});
+
+describe(@"Test QwasiLocationIndex", ^{
+    
+    it(@"applies a delta and keeps unchanged locations", ^{
+        NSDictionary* (^geofence)(NSString*, double) = ^NSDictionary*(NSString* _id, double lat) {
+            return @{ @"id": _id,
+                      @"name": _id,
+                      @"geofence": @{ @"geometry": @{ @"type": @"Point",
+                                                      @"coordinates": @[ @(-74.0), @(lat) ] },
+                                      @"properties": @{ @"radius": @50 } } };
+        };
+        
+        QwasiLocation* a = [[QwasiLocation alloc] initWithLocationData: geofence(@"a", 40.70)];
+        QwasiLocation* b = [[QwasiLocation alloc] initWithLocationData: geofence(@"b", 40.71)];
+        QwasiLocation* c = [[QwasiLocation alloc] initWithLocationData: geofence(@"c", 40.72)];
+        QwasiLocation* moved = [[QwasiLocation alloc] initWithLocationData: geofence(@"b", 40.715)];
+        CLLocation* center = [[CLLocation alloc] initWithLatitude: 40.71 longitude: -74.0];
+        
+        QwasiLocationIndex* index = [[QwasiLocationIndex alloc] initWithLocations: @[ a, b, c ] center: center radius: 10000 token: @"t1"];
+        QwasiLocationIndex* updated = [index indexByApplyingLocations: @[ moved ] removedIds: @[ @"c" ] token: @"t2"];
+        
+        expect(updated.locations.count).to.equal(2);
+        expect(updated.locations[0]).to.beIdenticalTo(a);
+        expect(updated.locations[1]).to.beIdenticalTo(moved);
+        expect(updated.token).to.equal(@"t2");
+        expect(updated.radius).to.equal(10000);
+        
+        NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"locations-index-test.json"];
+        
+        expect([updated writeToFile: path]).to.beTruthy();
+        
+        QwasiLocationIndex* restored = [QwasiLocationIndex indexWithContentsOfFile: path];
+        
+        expect(restored.token).to.equal(@"t2");
+        expect(restored.locations.count).to.equal(2);
+        expect([restored.updated timeIntervalSinceDate: updated.updated]).to.beCloseToWithin(0, 0.001);
+    });
+    
+    it(@"refreshes a retained location from a newer record", ^{
+        NSDictionary* (^beacon)(NSString*, double, double) = ^NSDictionary*(NSString* name, double dwell, double proximity) {
+            return @{ @"id": @"56a7d4f1e4b0a1b2c3d4e5fa",
+                      @"name": name,
+                      @"properties": @{ @"dwell_interval": @(dwell) },
+                      @"beacon": @{ @"type": @"ibeacon",
+                                    @"id": @[ @"8492E75F-4FD6-469D-B132-043FE94921D8", @1, @2 ],
+                                    @"proximity": @(proximity) } };
+        };
+        
+        QwasiLocation* location = [[QwasiLocation alloc] initWithLocationData: beacon(@"lobby", 120, 5)];
+        CLRegion* region = location.region;
+        
+        [location restoreInsideSince: [NSDate dateWithTimeIntervalSinceNow: -30]];
+        [location updateWithLocationData: beacon(@"front lobby", 300, 2)];
+        
+        expect(location.name).to.equal(@"front lobby");
+        expect(location.beaconProximity).to.equal(2);
+        expect(location.data[@"properties"][@"dwell_interval"]).to.equal(300);
+        expect(location.region).to.beIdenticalTo(region);
+        expect(location.state).to.equal(QwasiLocationStateInside);
+        expect(location.dwellTime).to.beGreaterThanOrEqualTo(30);
+        
+        [location exit];
+    });
+});
+
 SpecEnd
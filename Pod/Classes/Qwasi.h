@@ -32,8 +32,11 @@
 #import "QwasiConfig.h"
 #import "QwasiClient.h"
 #import "QwasiMessage.h"
+#import "QwasiMessageStore.h"
+#import "QwasiMessageIndex.h"
 #import "QwasiNotificationManager.h"
 #import "QwasiLocationManager.h"
+#import "QwasiClock.h"
 #import "EventEmitter.h"
 
 extern NSString* const kEventApplicationState;
@@ -58,18 +61,31 @@ extern NSString* const kEventLocationExit;
 @property (nonatomic,readwrite) BOOL pushEnabled;
 @property (nonatomic,readwrite) BOOL locationEnabled;
 @property (nonatomic,readwrite) BOOL useLocalNotifications;
+@property (nonatomic,readwrite) BOOL compressPayloads;
+
+/** Times trajectory flushes and location index refreshes, the system clock by default */
+@property (nonatomic,readwrite) QwasiClock* clock;
 @property (nonatomic,readwrite) CLLocationDistance locationUpdateFilter;
 @property (nonatomic,readwrite) CLLocationDistance locationEventFilter;
 @property (nonatomic,readwrite) CLLocationDistance locationSyncFilter;
 @property (nonatomic,readonly) QwasiLocation* lastLocation;
+@property (nonatomic,readonly) QwasiMessageStore* messageStore;
+@property (nonatomic,readonly) QwasiMessageIndex* messageIndex;
 
 /** Returns a shared Qwasi instance */
 + (instancetype)shared;
 
 + (NSString*)version;
 
++ (instancetype)qwasiWithConfig:(QwasiConfig*)config;
+
 - (id)initWithConfig:(QwasiConfig*)config;
 
+/** Sends every RPC through client, e.g. one that answers locally for tests and trace replays */
++ (instancetype)qwasiWithConfig:(QwasiConfig*)config client:(QwasiClient*)client;
+
+- (id)initWithConfig:(QwasiConfig*)config client:(QwasiClient*)client;
+
 - (void)registerDevice:(NSString*)deviceToken
               withName:(NSString*)name
          withUserToken:(NSString*)userToken
@@ -119,9 +135,22 @@ extern NSString* const kEventLocationExit;
                             success:(void(^)(QwasiMessage* message))success
                             failure:(void(^)(NSError* err))failure;
 
+/** Resolves every message id in a notification, from the message store where possible and
+ with one batched message.fetch for the rest, then calls success once they are all stored. */
+- (void)fetchMessagesForNotification:(NSDictionary*)userInfo
+                             success:(void(^)(NSArray* messages))success
+                             failure:(void(^)(NSError* err))failure;
+
 - (void)fetchUnreadMessage:(void(^)(QwasiMessage* message))success
                    failure:(void(^)(NSError* err))failure;
 
+/** Polls unread messages in batches of up to limit, delivering each to message as it arrives,
+ then calls success with the total once the inbox is drained. */
+- (void)fetchUnreadMessages:(NSUInteger)limit
+                    message:(void(^)(QwasiMessage* message))message
+                    success:(void(^)(NSUInteger count))success
+                    failure:(void(^)(NSError* err))failure;
+
 - (void)tryFetchUnreadMessages;
 
 - (void)postEvent:(NSString*)event
@@ -145,6 +174,22 @@ extern NSString* const kEventLocationExit;
                    success:(void(^)(NSArray* locations))success
                    failure:(void(^)(NSError* err))failure;
 
+- (void)fetchLocationsNear:(CLLocation*)location
+                    radius:(CLLocationDistance)radius
+                     limit:(NSUInteger)limit
+                   success:(void(^)(NSArray* locations))success
+                   failure:(void(^)(NSError* err))failure;
+
+/** Fetches page by page up to limit. With a token from an earlier fetch of the same area a server
+ may return only the locations changed since, removed then holds the ids it dropped; removed is nil
+ when locations is the full set. Unchanged records keep their existing QwasiLocation instance. */
+- (void)fetchLocationsNear:(CLLocation*)location
+                    radius:(CLLocationDistance)radius
+                     limit:(NSUInteger)limit
+                     since:(id)token
+                   success:(void(^)(NSArray* locations, NSArray* removed, id token))success
+                   failure:(void(^)(NSError* err))failure;
+
 - (void)subscribeToChannel:(NSString*)channel;
 
 - (void)subscribeToChannel:(NSString*)channel
@@ -201,4 +246,17 @@ extern NSString* const kEventLocationExit;
 - (void)sendMessage:(QwasiMessage*)message
         toUserToken:(NSString*)userToken;
 
+/** Sends one message to many recipients. The audience may hold user_tokens, channels and devices arrays;
+ the payload is encoded once and the audience is split into chunks sent a few at a time. success gets
+ the server responses in chunk order, failure is called once if any chunk failed. */
+- (void)sendMessage:(QwasiMessage*)message
+         toAudience:(NSDictionary*)audience
+            success:(void(^)(NSArray* results))success
+            failure:(void(^)(NSError* err))failure;
+
+- (void)sendMessage:(QwasiMessage*)message
+       toUserTokens:(NSArray*)userTokens
+            success:(void(^)(NSArray* results))success
+            failure:(void(^)(NSError* err))failure;
+
 @end
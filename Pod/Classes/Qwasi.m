@@ -31,13 +31,33 @@
 #import "GBDeviceInfo.h"
 #import "NSObject+STSwizzle.h"
 #import "QwasiAppManager.h"
+#import "QwasiLocationIndex.h"
+#import "QwasiTrajectory.h"
 #import "Version.h"
 
 #define LOCATION_EVENT_FILTER 50.0f
 #define LOCATION_UPDATE_FILTER 100.0f
 #define LOCATION_SYNC_FILTER 200.0f
+
+#define LOCATION_MONITOR_LIMIT 20
+#define LOCATION_INDEX_LIMIT 500
+#define LOCATION_INDEX_SCALE 50
+#define LOCATION_INDEX_MAX_AGE 24 * 60 * 60
+#define LOCATION_INDEX_REFRESH 60 * 60
+#define LOCATION_FETCH_PAGE 100
 #define PED_FILTER 10.0f
 
+#define TRAJECTORY_TOLERANCE 10.0f
+#define TRAJECTORY_MAX_FIXES 100
+#define TRAJECTORY_MAX_DURATION 300
+#define TRAJECTORY_MAX_GAP 300
+
+#define UNREAD_POLL_LIMIT 20
+
+#define SEND_AUDIENCE_CHUNK 100
+#define SEND_MAX_CONCURRENT 4
+#define SEND_COMPRESS_THRESHOLD 1024
+
 #define UPDATE_FILTER(speed, filter) (speed / PED_FILTER) * filter
 
 NSString* const kEventApplicationState = @"com.qwasi.event.application.state";
@@ -49,12 +69,21 @@ NSString* const kEventLocationExit = @"com.qwasi.event.location.exit";
 typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
 
 @implementation Qwasi {
+    // fixes stay CLLocations, the public lastLocation is only wrapped when someone asks for it
+    CLLocation* _lastFix;
+    QwasiLocation* _lastLocation;
+    
     CLLocation* _lastLocationEvent;
     CLLocation* _lastLocationUpdate;
     CLLocation* _lastLocationSync;
     
-    NSCache* _messageCache;
     NSArray* _locations;
+    QwasiLocationIndex* _locationIndex;
+    QwasiTrajectory* _trajectory;
+    id _trajectoryTimer;
+    BOOL _locationRefreshing;
+    BOOL _locationFetching;
+    CLLocation* _pendingLocationFetch;
     NSMutableArray* _filteredTags;
     
     dispatch_once_t _locationOnce;
@@ -81,18 +110,30 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
     return [[Qwasi alloc] initWithConfig: config];
 }
 
++ (instancetype)qwasiWithConfig:(QwasiConfig*)config client:(QwasiClient*)client {
+    return [[Qwasi alloc] initWithConfig: config client: client];
+}
+
 + (NSString*)version {
     return VERSION_STRING;
 }
 
 - (id)initWithConfig:(QwasiConfig*)config {
+    return [self initWithConfig: config client: [QwasiClient clientWithConfig: config]];
+}
+
+- (id)initWithConfig:(QwasiConfig*)config client:(QwasiClient*)client {
     if (self = [super init]) {
         
         _registered = NO;
         
         _pushRegistered = NO;
         
-        self.config = config;
+        _config = config;
+        
+        _client = client;
+        
+        _clock = [QwasiClock systemClock];
         
         _locationUpdateFilter = LOCATION_UPDATE_FILTER;
         _locationEventFilter = LOCATION_EVENT_FILTER;
@@ -100,7 +141,11 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
         
         _useLocalNotifications = YES;
         
-        _messageCache = [[NSCache alloc] init];
+        _compressPayloads = NO;
+        
+        _messageStore = [QwasiMessageStore defaultStore];
+        
+        _messageIndex = [QwasiMessageIndex defaultIndex];
         
         _userToken = @"";
         
@@ -108,12 +153,16 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
         
         _filteredTags = [[NSMutableArray alloc] init];
         
+        _trajectory = [[QwasiTrajectory alloc] initWithTolerance: TRAJECTORY_TOLERANCE];
+        
         [[QwasiAppManager shared] on: @"didFinishLaunching" listener: ^() {
             [self tryPostEvent: kEventApplicationState withData: @{ @"state": @"open" }];
         }];
         
         [[QwasiAppManager shared] on: @"willTerminate" listener: ^() {
             
+            [self flushTrajectory];
+            
             [self tryPostEvent: kEventApplicationState withData: @{ @"state": @"exit" }];
             
             [NSThread sleepForTimeInterval:.5];
@@ -124,6 +173,8 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
         }];
         
         [[QwasiAppManager shared] on: @"didEnterBackground" listener: ^() {
+            [self flushTrajectory];
+            
             [self tryPostEvent: kEventApplicationState withData: @{ @"state": @"background" }];
         }];
     }
@@ -150,6 +201,16 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
     }
 }
 
+- (QwasiLocation*)lastLocation {
+    @synchronized(self) {
+        if (!_lastLocation && _lastFix) {
+            _lastLocation = [[QwasiLocation alloc] initWithLocation: _lastFix];
+        }
+        
+        return _lastLocation;
+    }
+}
+
 - (void)setLocationEnabled:(BOOL)locationEnabled {
     _locationEnabled = locationEnabled;
     
@@ -160,46 +221,53 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
         }
         
         dispatch_once(&_locationOnce, ^{
-            [_locationManager on: @"location" listener: ^(QwasiLocation* location) {
+            
+            // Warm start from the regions and index saved by the last launch
+            _locations = _locationManager.locations;
+            _locationIndex = [self loadLocationIndex];
+            
+            [_locationManager on: @"location" listener: ^(CLLocation* location) {
                 @synchronized(self) {
                     CLLocationSpeed speed = location.speed;
                     
-                    _lastLocation = [[QwasiLocation alloc] initWithLocation: location];
+                    // fixes are never mutated, share the manager's instance rather than copying it
+                    _lastFix = location;
+                    _lastLocation = nil;
                     
                     
                     if (!_lastLocationEvent || [location distanceFromLocation: _lastLocationEvent] > MAX(LOCATION_EVENT_FILTER, UPDATE_FILTER(speed, _locationEventFilter))) {
                         
-                        [self tryPostEvent: kEventLocationUpdate withData:@{ @"lat": [NSNumber numberWithFloat: location.coordinate.latitude],
-                                                                             @"lng": [NSNumber numberWithFloat: location.coordinate.longitude] }];
+                        // a long pause ends the segment, the next one starts from here
+                        if (_lastLocationEvent && [location.timestamp timeIntervalSinceDate: _lastLocationEvent.timestamp] > TRAJECTORY_MAX_GAP) {
+                            [self flushTrajectory];
+                        }
+                        
+                        [_trajectory addLocation: location];
+                        
+                        // the first fix goes out straight away so the server knows where the device is
+                        if (!_lastLocationEvent || _trajectory.count >= TRAJECTORY_MAX_FIXES || _trajectory.duration >= TRAJECTORY_MAX_DURATION) {
+                            [self flushTrajectory];
+                        }
+                        else {
+                            [self armTrajectoryTimer];
+                        }
                         
                         _lastLocationEvent = location;
                     }
                     
                     if (!_lastLocationUpdate || [location distanceFromLocation: _lastLocationUpdate] > UPDATE_FILTER(speed, _locationUpdateFilter)) {
                         
-                        [self emit: @"location", location];
+                        [self emit: @"location", self.lastLocation];
                         
                         _lastLocationUpdate = location;
                     }
                     
                     if (!_lastLocationSync || [location distanceFromLocation: _lastLocationSync] > MAX(LOCATION_SYNC_FILTER, UPDATE_FILTER(speed, _locationSyncFilter))) {
                         
-                        [self fetchLocationsNear: location success:^(NSArray* locations){
-                            
-                            for (QwasiLocation* location in _locations) {
-                                [_locationManager stopMonitoringLocation: location];
-                            }
-                            
-                            _locations = locations;
-                            
-                            for (QwasiLocation* location in locations) {
-                                [_locationManager startMonitoringLocation: location];
-                            }
-                        } failure:^(NSError *err) {
-                            err = [QwasiError locationSyncFailed: err];
-                            
-                            [self emit: @"error", err];
-                        }];
+                        // the server sees the path up to here before it's asked what's nearby
+                        [self flushTrajectory];
+                        
+                        [self syncLocationsNear: location];
                         
                         _lastLocationSync = location;
                     }
@@ -212,8 +280,8 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
                 
                 data[@"id"] = location.id;
                 data[@"name"] = location.name;
-                data[@"lng"] = [NSNumber numberWithDouble: _lastLocation.longitude];
-                data[@"lat"] = [NSNumber numberWithDouble: _lastLocation.latitude];
+                data[@"lng"] = [NSNumber numberWithDouble: _lastFix.coordinate.longitude];
+                data[@"lat"] = [NSNumber numberWithDouble: _lastFix.coordinate.latitude];
                 data[@"dwellTime"] = [NSNumber numberWithDouble: location.dwellTime];
                 
                 if (location.type == QwasiLocationTypeBeacon) {
@@ -223,7 +291,7 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
                                          @"min_ver": [NSNumber numberWithDouble: location.beaconMinorVersion] };
                 }
                 else {
-                    data[@"distance"] = [NSNumber numberWithDouble: [_lastLocation distanceFromLocation: location]];
+                    data[@"distance"] = [NSNumber numberWithDouble: [_lastFix distanceFromLocation: location]];
                 }
                 
                 [self tryPostEvent: kEventLocationEnter withData: data];
@@ -236,8 +304,8 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
                 
                 data[@"id"] = location.id;
                 data[@"name"] = location.name;
-                data[@"lng"] = [NSNumber numberWithDouble: _lastLocation.longitude];
-                data[@"lat"] = [NSNumber numberWithDouble: _lastLocation.latitude];
+                data[@"lng"] = [NSNumber numberWithDouble: _lastFix.coordinate.longitude];
+                data[@"lat"] = [NSNumber numberWithDouble: _lastFix.coordinate.latitude];
                 data[@"dwellTime"] = [NSNumber numberWithDouble: location.dwellTime];
                 
                 if (location.type == QwasiLocationTypeBeacon) {
@@ -247,7 +315,7 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
                                          @"min_ver": [NSNumber numberWithDouble: location.beaconMinorVersion] };
                 }
                 else {
-                    data[@"distance"] = [NSNumber numberWithDouble: [_lastLocation distanceFromLocation: location]];
+                    data[@"distance"] = [NSNumber numberWithDouble: [_lastFix distanceFromLocation: location]];
                 }
                 
                 [self tryPostEvent: kEventLocationDwell withData: data];
@@ -260,8 +328,8 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
                 
                 data[@"id"] = location.id;
                 data[@"name"] = location.name;
-                data[@"lng"] = [NSNumber numberWithDouble: _lastLocation.longitude];
-                data[@"lat"] = [NSNumber numberWithDouble: _lastLocation.latitude];
+                data[@"lng"] = [NSNumber numberWithDouble: _lastFix.coordinate.longitude];
+                data[@"lat"] = [NSNumber numberWithDouble: _lastFix.coordinate.latitude];
                 data[@"dwellTime"] = [NSNumber numberWithDouble: location.dwellTime];
                 
                 if (location.type == QwasiLocationTypeBeacon) {
@@ -271,7 +339,7 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
                                          @"min_ver": [NSNumber numberWithDouble: location.beaconMinorVersion] };
                 }
                 else {
-                    data[@"distance"] = [NSNumber numberWithDouble: [_lastLocation distanceFromLocation: location]];
+                    data[@"distance"] = [NSNumber numberWithDouble: [_lastFix distanceFromLocation: location]];
                 }
                 
                 [self tryPostEvent: kEventLocationExit withData: data];
@@ -290,6 +358,7 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
         
         [_locationManager stopLocationUpdates];
         
+        _lastFix = nil;
         _lastLocation = nil;
         _lastLocationSync = nil;
         _lastLocationEvent = nil;
@@ -405,7 +474,7 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
                       // check for launch notification
                       NSDictionary* note = [QwasiNotificationManager shared].launchNotification;
                       if (note != nil) {
-                          [[QwasiNotificationManager shared] emit: @"notification", note];
+                          [[QwasiNotificationManager shared] emit: @"notification", note, nil];
                       }
                       
                   }
@@ -561,7 +630,7 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
             }];
             
             
-            [[QwasiNotificationManager shared] on: @"notification" listener: ^(NSDictionary* userInfo) {
+            [[QwasiNotificationManager shared] on: @"notification" listener: ^(NSDictionary* userInfo, dispatch_block_t (^defer)(void)) {
                 
                 NSArray* qwasi = userInfo[@"qwasi"];
                 
@@ -570,24 +639,32 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
                     
                     if (appId && [appId isEqualToString: _config.application]) {
                         
-                        [self fetchMessageForNotification: userInfo success:^(QwasiMessage *message) {
-                            
-                            BOOL filtered = NO;
+                        // hold the fetch completion handler until every message is stored
+                        dispatch_block_t done = defer ? defer() : nil;
+                        
+                        [self fetchMessagesForNotification: userInfo success:^(NSArray *messages) {
                             
-                            filtered = [self checkMessageTags: message];
+                            dispatch_group_t delivered = dispatch_group_create();
                             
-                            if (!filtered) {
-                                [self emit: @"message", message];
+                            for (QwasiMessage* message in messages) {
+                                dispatch_group_enter(delivered);
                                 
-                                [[QwasiNotificationManager shared] emit: @"message", message, self];
+                                [self deliverMessage: message completion:^{
+                                    dispatch_group_leave(delivered);
+                                }];
                             }
                             
+                            dispatch_group_notify(delivered, dispatch_get_main_queue(), ^{
+                                if (done) done();
+                            });
+                            
                         } failure:^(NSError *err) {
                             
                             err = [QwasiError messageFetchFailed: err];
                             
                             [self emit: @"error", err];
                             
+                            if (done) done();
                         }];
                     }
                 }
@@ -595,29 +672,31 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
             
             [[QwasiAppManager shared] on: @"backgroundFetch" listener: ^() {
                 
-                [self fetchUnreadMessage:^(QwasiMessage *message) {
+                // drains the inbox in batches, like the foreground poll, rather than one message per wake
+                [self fetchUnreadMessages: UNREAD_POLL_LIMIT message:^(QwasiMessage *message) {
+                    
+                    // filtered, or already delivered by a push or an earlier poll
+                    if (![self deliverMessage: message]) {
+                        return;
+                    }
                     
-                    if (_useLocalNotifications && [UIApplication sharedApplication].applicationState != UIApplicationStateActive ) {
+                    if (_useLocalNotifications && message.messageId && [UIApplication sharedApplication].applicationState != UIApplicationStateActive ) {
                         UILocalNotification* localNotification = [[UILocalNotification alloc] init];
                         
                         localNotification.fireDate = [NSDate dateWithTimeIntervalSinceNow: 0];
                         localNotification.alertBody = message.alert;
-                        localNotification.userInfo = @{ @"qwasi": [NSKeyedArchiver archivedDataWithRootObject: message] };
+                        // same shape as a push, the message itself is resolved from the store when opened
+                        localNotification.userInfo = @{ @"qwasi": @[ message.messageId, [NSNull null], _config.application ] };
                         
                         [[UIApplication sharedApplication] scheduleLocalNotification:localNotification];
                     }
                     
-                    [self emit: @"message", message];
+                } success: nil failure:^(NSError *err) {
                     
-                    [[QwasiNotificationManager shared] emit: @"message", message, self];
+                    // an empty inbox is not reported as a failure
+                    NSLog(@"Unexpected server error: %@", err);
                     
-                } failure:^(NSError *err) {
-                    if (err.code != QwasiErrorMessageNotFound) {
-                        
-                        NSLog(@"Unexpected server error: %@", err);
-                        
-                        [self emit: @"error", err];
-                    }
+                    [self emit: @"error", err];
                 }];
             }];
             
@@ -668,14 +747,16 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
     }
 }
 
+- (NSDictionary*)messageFetchFlags {
+    return @{ @"opened": [NSNumber numberWithBool: [UIApplication sharedApplication].applicationState == UIApplicationStateInactive] };
+}
+
 - (void)fetchMessageForNotification:(NSDictionary*)userInfo
                             success:(void(^)(QwasiMessage* message))success
                             failure:(void(^)(NSError* err))failure {
     
     if (_registered) {
         
-        NSDictionary* flags = @{ @"opened": [NSNumber numberWithBool: [UIApplication sharedApplication].applicationState == UIApplicationStateInactive] };
-        
         NSArray* qwasi = userInfo[@"qwasi"];
         NSString* appId = qwasi[2];
         NSString* msgId = qwasi[0];
@@ -684,60 +765,17 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
         if (msgId && appId) {
             if ([appId isEqualToString: _config.application]) {
                 
-                NSData* cachedMessage = [_messageCache objectForKey: msgId];
+                QwasiMessage* cachedMessage = [_messageStore messageForId: msgId updateFlags: YES];
                 
                 if (!cachedMessage) {
-                    
-                    UIBackgroundTaskIdentifier bgTask = [[UIApplication sharedApplication] beginBackgroundTaskWithExpirationHandler: nil];
-                    
-                    [_client invokeMethod: @"message.fetch"
-                           withParameters: @{ @"device": _deviceToken,
-                                              @"id": msgId,
-                                              @"flags": flags }
-                                  success:^(AFHTTPRequestOperation *operation, id responseObject) {
-                                      QwasiMessage* message = [QwasiMessage messageWithData: responseObject];
-                                      
-                                      [_messageCache setObject: [NSKeyedArchiver archivedDataWithRootObject: message] forKey: message.messageId];
-                                      
-                                      if (success) success(message);
-                                      
-                                      if (bgTask != UIBackgroundTaskInvalid) {
-                                          [[UIApplication sharedApplication] endBackgroundTask:bgTask];
-                                      }
-                                      
-                                  } failure:^(AFHTTPRequestOperation *operation, NSError *error) {
-                                      
-                                      NSData* errData = error.userInfo[@"com.alamofire.serialization.response.error.data"];
-                                      
-                                      if (errData) {
-                                          NSError* parseError;
-                                          NSDictionary* jsonError = [NSJSONSerialization JSONObjectWithData: errData options: kNilOptions error: &parseError];
-                                          
-                                          if (parseError) {
-                                              NSLog(@"Failed to parse server error response: %@", parseError);
-                                              
-                                              [self emit: @"error", parseError];
-                                          }
-                                          else {
-                                              error = [QwasiError apiError: jsonError];
-                                          }
-                                      }
-                                      else {
-                                          error = [QwasiError messageFetchFailed: error];
-                                      }
-                                      
-                                      if (failure) failure(error);
-                                      
-                                      if (bgTask != UIBackgroundTaskInvalid) {
-                                          [[UIApplication sharedApplication] endBackgroundTask:bgTask];
-                                      }
-                                      
-                                  }];
+                    [self fetchMessage: msgId success: success failure: failure];
                 }
                 else {
-                    QwasiMessage* message = [QwasiMessage messageWithArchive: cachedMessage updateFlags: YES];
+                    if (cachedMessage.selected) {
+                        [_messageStore markMessage: msgId read: YES];
+                    }
                     
-                    if (success && message) success(message);
+                    if (success) success(cachedMessage);
                 }
             }
         }
@@ -762,28 +800,359 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
     }
 }
 
-- (void)tryFetchUnreadMessages {
+- (void)fetchMessagesForNotification:(NSDictionary*)userInfo
+                             success:(void(^)(NSArray* messages))success
+                             failure:(void(^)(NSError* err))failure {
     
     if (_registered) {
-        [self fetchUnreadMessage:^(QwasiMessage *message) {
+        
+        NSArray* qwasi = userInfo[@"qwasi"];
+        NSString* appId = qwasi.count > 2 ? qwasi[2] : nil;
+        id ids = qwasi.count > 0 ? qwasi[0] : nil;
+        
+        // a notification can carry a single message id or a list of them
+        if ([ids isKindOfClass: [NSString class]]) {
+            ids = @[ ids ];
+        }
+        
+        if ([ids isKindOfClass: [NSArray class]] && [ids count] > 0 && appId) {
+            if ([appId isEqualToString: _config.application]) {
+                
+                NSMutableDictionary* found = [[NSMutableDictionary alloc] init];
+                NSMutableArray* misses = [[NSMutableArray alloc] init];
+                
+                for (NSString* msgId in ids) {
+                    QwasiMessage* cachedMessage = [_messageStore messageForId: msgId updateFlags: YES];
+                    
+                    if (cachedMessage) {
+                        if (cachedMessage.selected) {
+                            [_messageStore markMessage: msgId read: YES];
+                        }
+                        
+                        found[msgId] = cachedMessage;
+                    }
+                    else if (![misses containsObject: msgId]) {
+                        [misses addObject: msgId];
+                    }
+                }
+                
+                void (^finish)(NSArray*, NSError*) = ^(NSArray* fetched, NSError* err) {
+                    NSMutableArray* messages = [[NSMutableArray alloc] init];
+                    
+                    for (QwasiMessage* message in fetched) {
+                        if (message.messageId) {
+                            found[message.messageId] = message;
+                        }
+                    }
+                    
+                    // deliver in the order the notification listed them
+                    for (NSString* msgId in ids) {
+                        if (found[msgId] && ![messages containsObject: found[msgId]]) {
+                            [messages addObject: found[msgId]];
+                        }
+                    }
+                    
+                    if (err && messages.count == 0) {
+                        if (failure) failure(err);
+                    }
+                    else if (success) {
+                        success(messages);
+                    }
+                };
+                
+                if (misses.count == 0) {
+                    finish(nil, nil);
+                }
+                else if (misses.count == 1) {
+                    [self fetchMessage: misses[0] success:^(QwasiMessage *message) {
+                        finish(@[ message ], nil);
+                    } failure:^(NSError *err) {
+                        finish(nil, err);
+                    }];
+                }
+                else {
+                    [self fetchMessages: misses success:^(NSArray *messages) {
+                        finish(messages, nil);
+                    } failure:^(NSError *err) {
+                        finish(nil, err);
+                    }];
+                }
+            }
+        }
+        else {
+            NSError* error = [QwasiError invalidMessage];
             
-            BOOL filtered = NO;
+            if (failure) {
+                failure(error);
+            }
             
-            filtered = [self checkMessageTags: message];
+            [self emit: @"error", error];
+        }
+    }
+    else {
+        NSError* error = [QwasiError messageFetchFailed: [QwasiError deviceNotRegistered]];
+        
+        if (failure) {
+            failure(error);
+        }
+        
+        [self emit: @"error", error];
+    }
+}
+
+- (void)fetchMessage:(NSString*)msgId
+             success:(void(^)(QwasiMessage* message))success
+             failure:(void(^)(NSError* err))failure {
+    
+    UIBackgroundTaskIdentifier bgTask = [[UIApplication sharedApplication] beginBackgroundTaskWithExpirationHandler: nil];
+    
+    [_client invokeMethod: @"message.fetch"
+           withParameters: @{ @"device": _deviceToken,
+                              @"id": msgId,
+                              @"flags": [self messageFetchFlags] }
+                  success:^(AFHTTPRequestOperation *operation, id responseObject) {
+                      QwasiMessage* message = [QwasiMessage messageWithData: responseObject];
+                      
+                      [_messageStore storeMessage: message];
+                      
+                      if (success) success(message);
+                      
+                      if (bgTask != UIBackgroundTaskInvalid) {
+                          [[UIApplication sharedApplication] endBackgroundTask:bgTask];
+                      }
+                      
+                  } failure:^(AFHTTPRequestOperation *operation, NSError *error) {
+                      
+                      error = [self messageFetchError: error];
+                      
+                      if (failure) failure(error);
+                      
+                      if (bgTask != UIBackgroundTaskInvalid) {
+                          [[UIApplication sharedApplication] endBackgroundTask:bgTask];
+                      }
+                      
+                  }];
+}
+
+- (void)fetchMessages:(NSArray*)msgIds
+              success:(void(^)(NSArray* messages))success
+              failure:(void(^)(NSError* err))failure {
+    
+    UIBackgroundTaskIdentifier bgTask = [[UIApplication sharedApplication] beginBackgroundTaskWithExpirationHandler: nil];
+    
+    void (^complete)(NSArray*, NSError*) = ^(NSArray* messages, NSError* err) {
+        if (err && messages.count == 0) {
+            if (failure) failure(err);
+        }
+        else if (success) {
+            success(messages);
+        }
+        
+        if (bgTask != UIBackgroundTaskInvalid) {
+            [[UIApplication sharedApplication] endBackgroundTask:bgTask];
+        }
+    };
+    
+    // servers without multi-id fetch get the ids as individual, concurrent requests
+    void (^fetchEach)(void) = ^{
+        dispatch_group_t group = dispatch_group_create();
+        NSMutableArray* messages = [[NSMutableArray alloc] init];
+        __block NSError* lastError = nil;
+        
+        for (NSString* msgId in msgIds) {
+            dispatch_group_enter(group);
             
-            if( !filtered){
+            [self fetchMessage: msgId success:^(QwasiMessage *message) {
+                @synchronized(messages) {
+                    [messages addObject: message];
+                }
                 
-                [self emit: @"message", message];
+                dispatch_group_leave(group);
                 
-                [[QwasiNotificationManager shared] emit: @"message", message, self];
-            }
+            } failure:^(NSError *err) {
+                lastError = err;
+                
+                dispatch_group_leave(group);
+            }];
+        }
+        
+        dispatch_group_notify(group, dispatch_get_main_queue(), ^{
+            complete(messages, lastError);
+        });
+    };
+    
+    [_client invokeMethod: @"message.fetch"
+           withParameters: @{ @"device": _deviceToken,
+                              @"ids": msgIds,
+                              @"flags": [self messageFetchFlags] }
+                  success:^(AFHTTPRequestOperation *operation, id responseObject) {
+                      
+                      NSArray* batch = nil;
+                      
+                      if ([responseObject isKindOfClass: [NSArray class]]) {
+                          batch = responseObject;
+                      }
+                      else if ([responseObject isKindOfClass: [NSDictionary class]] && [responseObject[@"messages"] isKindOfClass: [NSArray class]]) {
+                          batch = responseObject[@"messages"];
+                      }
+                      
+                      if (!batch) {
+                          fetchEach();
+                          return;
+                      }
+                      
+                      NSMutableArray* messages = [[NSMutableArray alloc] init];
+                      
+                      for (NSDictionary* data in batch) {
+                          QwasiMessage* message = [QwasiMessage messageWithData: data];
+                          
+                          [_messageStore storeMessage: message];
+                          
+                          [messages addObject: message];
+                      }
+                      
+                      complete(messages, nil);
+                      
+                  } failure:^(AFHTTPRequestOperation *operation, NSError *error) {
+                      
+                      fetchEach();
+                  }];
+}
+
+- (void)tryFetchUnreadMessages {
+    
+    if (_registered) {
+        [self fetchUnreadMessages: UNREAD_POLL_LIMIT message:^(QwasiMessage *message) {
             
-            [self tryFetchUnreadMessages];
+            [self deliverMessage: message];
+            
+        } success: nil failure: nil];
+    }
+}
+
+- (void)fetchUnreadMessages:(NSUInteger)limit
+                    message:(void(^)(QwasiMessage* message))message
+                    success:(void(^)(NSUInteger count))success
+                    failure:(void(^)(NSError* err))failure {
+    if (_registered) {
+        
+        // One background task covers every page
+        UIBackgroundTaskIdentifier bgTask = [[UIApplication sharedApplication] beginBackgroundTaskWithExpirationHandler: nil];
+        
+        [self pollUnreadMessages: MAX(limit, 1) cursor: nil count: 0 message: message completion:^(NSUInteger count, NSError *err) {
             
-        } failure:^(NSError *err) {
+            if (err && err.code != QwasiErrorMessageNotFound) {
+                if (failure) failure(err);
+            }
+            else if (success) {
+                success(count);
+            }
             
+            if (bgTask != UIBackgroundTaskInvalid) {
+                [[UIApplication sharedApplication] endBackgroundTask:bgTask];
+            }
         }];
     }
+    else {
+        NSError* error = [QwasiError messageFetchFailed: [QwasiError deviceNotRegistered]];
+        
+        if (failure) {
+            failure(error);
+        }
+        
+        [self emit: @"error", error];
+    }
+}
+
+- (void)pollUnreadMessages:(NSUInteger)limit
+                    cursor:(id)cursor
+                     count:(NSUInteger)count
+                   message:(void(^)(QwasiMessage* message))each
+                completion:(void(^)(NSUInteger count, NSError* err))completion {
+    
+    NSMutableDictionary* options = [[NSMutableDictionary alloc] init];
+    
+    options[@"fetch"] = [NSNumber numberWithBool: YES];
+    options[@"limit"] = [NSNumber numberWithUnsignedInteger: limit];
+    
+    if (cursor) {
+        options[@"cursor"] = cursor;
+    }
+    
+    [_client invokeMethod: @"message.poll"
+           withParameters: @{ @"device": _deviceToken,
+                              @"options": options }
+                  success:^(AFHTTPRequestOperation *operation, id responseObject) {
+                      
+                      NSArray* batch = nil;
+                      id next = nil;
+                      BOOL more = NO;
+                      
+                      if ([responseObject isKindOfClass: [NSArray class]]) {
+                          batch = responseObject;
+                          more = (batch.count >= limit);
+                      }
+                      else if ([responseObject isKindOfClass: [NSDictionary class]] && responseObject[@"messages"]) {
+                          batch = responseObject[@"messages"];
+                          next = responseObject[@"cursor"];
+                          
+                          if ([next isKindOfClass: [NSNull class]]) {
+                              next = nil;
+                          }
+                          
+                          more = (next != nil) || (batch.count >= limit);
+                      }
+                      else if ([responseObject isKindOfClass: [NSDictionary class]]) {
+                          // server without batch support returns a single message, keep polling until empty
+                          batch = @[ responseObject ];
+                          more = YES;
+                      }
+                      
+                      NSUInteger delivered = count;
+                      
+                      for (NSDictionary* data in batch) {
+                          QwasiMessage* message = [QwasiMessage messageWithData: data];
+                          
+                          [_messageStore storeMessage: message];
+                          
+                          delivered++;
+                          
+                          if (each) each(message);
+                      }
+                      
+                      if (more && batch.count > 0) {
+                          [self pollUnreadMessages: limit cursor: next count: delivered message: each completion: completion];
+                      }
+                      else {
+                          completion(delivered, nil);
+                      }
+                      
+                  } failure:^(AFHTTPRequestOperation *operation, NSError *error) {
+                      
+                      completion(count, [self messageFetchError: error]);
+                  }];
+}
+
+- (NSError*)messageFetchError:(NSError*)error {
+    
+    NSData* errData = error.userInfo[@"com.alamofire.serialization.response.error.data"];
+    
+    if (errData) {
+        NSError* parseError;
+        NSDictionary* jsonError = [NSJSONSerialization JSONObjectWithData: errData options: kNilOptions error: &parseError];
+        
+        if (parseError) {
+            NSLog(@"Failed to parse server error response: %@", parseError);
+            
+            [self emit: @"error", parseError];
+            
+            return error;
+        }
+        
+        return [QwasiError apiError: jsonError];
+    }
+    
+    return [QwasiError messageFetchFailed: error];
 }
 
 - (void)fetchUnreadMessage:(void(^)(QwasiMessage* message))success
@@ -799,7 +1168,7 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
                           
                           QwasiMessage* message = [QwasiMessage messageWithData: responseObject];
                           
-                          [_messageCache setObject: [NSKeyedArchiver archivedDataWithRootObject: message] forKey: message.messageId];
+                          [_messageStore storeMessage: message];
                           
                           if (success) success(message);
                           
@@ -809,26 +1178,7 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
                           
                       } failure:^(AFHTTPRequestOperation *operation, NSError *error) {
                           
-                          NSData* errData = error.userInfo[@"com.alamofire.serialization.response.error.data"];
-                          
-                          if (errData) {
-                              NSError* parseError;
-                              NSDictionary* jsonError = [NSJSONSerialization JSONObjectWithData: errData options: kNilOptions error: &parseError];
-                              
-                              if (parseError) {
-                                  NSLog(@"Failed to parse server error response: %@", parseError);
-                                  
-                                  [self emit: @"error", parseError];
-                              }
-                              else {
-                                  error = [QwasiError apiError: jsonError];
-                              }
-                          }
-                          else {
-                              error = [QwasiError messageFetchFailed: error];
-                          }
-                          
-                          if (failure) failure(error);
+                          if (failure) failure([self messageFetchError: error]);
                           
                           if (bgTask != UIBackgroundTaskInvalid) {
                               [[UIApplication sharedApplication] endBackgroundTask:bgTask];
@@ -864,6 +1214,32 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
     [_filteredTags removeObject: tag];
 }
 
+- (BOOL)deliverMessage:(QwasiMessage*)message {
+    return [self deliverMessage: message completion: nil];
+}
+
+// completion runs once the message has been emitted, or straight away if it was filtered or already delivered
+- (BOOL)deliverMessage:(QwasiMessage*)message completion:(dispatch_block_t)completion {
+    
+    // the same message can arrive by push, poll and local notification
+    if ([self checkMessageTags: message] || ![_messageIndex markDelivered: message]) {
+        if (completion) completion();
+        
+        return NO;
+    }
+    
+    // the payload, images especially, is decoded off the main thread before any listener reads it
+    [message payloadWithCompletion:^(id payload) {
+        [self emit: @"message", message];
+        
+        [[QwasiNotificationManager shared] emit: @"message", message, self];
+        
+        if (completion) completion();
+    }];
+    
+    return YES;
+}
+
 - (BOOL)checkMessageTags:(QwasiMessage*)message{
     
     BOOL filtered = NO;
@@ -954,62 +1330,316 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
     }
 }
 
-- (void)fetchLocationsNear:(CLLocation*)location
-                   success:(void(^)(NSArray* locations))success
-                   failure:(void(^)(NSError* err))failure {
-    if (_registered) {
+// Flushes a buffered segment that stops getting fixes, so a pause doesn't hold it back until the next move
+- (void)armTrajectoryTimer {
+    
+    @synchronized(self) {
+        if (!_trajectoryTimer && _trajectory.count > 0) {
+            __weak Qwasi* weakSelf = self;
+            
+            _trajectoryTimer = [_clock scheduleAfter: TRAJECTORY_MAX_DURATION
+                                              leeway: 1
+                                               queue: dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0)
+                                               block: ^{
+                                                   [weakSelf flushTrajectory];
+                                               }];
+        }
+    }
+}
+
+- (void)flushTrajectory {
+    NSDictionary* segment;
+    
+    @synchronized(self) {
+        if (_trajectoryTimer) {
+            [_clock cancelTimer: _trajectoryTimer];
+            
+            _trajectoryTimer = nil;
+        }
         
-        UIBackgroundTaskIdentifier bgTask = [[UIApplication sharedApplication] beginBackgroundTaskWithExpirationHandler: nil];
+        segment = [_trajectory encodedSegment];
         
-        [_client invokeMethod: @"location.fetch"
-               withParameters: @{ @"near": @{ @"lng": [NSNumber numberWithDouble: location.coordinate.longitude],
-                                              @"lat": [NSNumber numberWithDouble: location.coordinate.latitude],
-                                              @"radius": [NSNumber numberWithDouble: _locationSyncFilter * 10] },
-                                  @"options": @{ @"schema": @"2.0" },
-                                  @"limit": [NSNumber numberWithInt: 20] }
-                      success:^(AFHTTPRequestOperation *operation, id responseObject) {
-                          
-                          if (success) {
-                              NSArray* response = (NSArray*)responseObject;
-                              NSInteger count = [[response valueForKey: @"length"] integerValue];
-                              NSDictionary* values = [response valueForKey: @"value"];
-                              NSMutableArray* locations = [[NSMutableArray alloc] init];
-                              
-                              NSLog(@"Fetched %lu locations from server.", (unsigned long)count);
-                              
-                              for (NSDictionary* data in values) {
-                                  QwasiLocation* _loc = [[QwasiLocation alloc] initWithLocationData: data];
-                                  
-                                  if ((_loc.type != QwasiLocationTypeBeacon) ||
-                                      [_loc.vendor isEqualToString: @"ibeacon"]) {
-                                      
-                                      [locations addObject: _loc];
-                                  }
-                                  else {
-                                      NSLog(@"Ignoring unsupported location %@", _loc);
-                                  }
-                              }
-                              
-                              success(locations);
-                          }
-                          
-                          if (bgTask != UIBackgroundTaskInvalid) {
-                              [[UIApplication sharedApplication] endBackgroundTask:bgTask];
-                          }
-                          
-                      } failure:^(AFHTTPRequestOperation *operation, NSError *error) {
-                          
-                          error = [QwasiError locationFetchFailed: error];
-                          
-                          if (failure) failure(error);
-                          
-                          [self emit: @"error", error];
-                          
-                          if (bgTask != UIBackgroundTaskInvalid) {
-                              [[UIApplication sharedApplication] endBackgroundTask:bgTask];
-                          }
-                      }];
+        [_trajectory removeAllLocations];
+    }
+    
+    if (segment) {
+        [self tryPostEvent: kEventLocationUpdate withData: segment];
+    }
+}
+
+- (void)syncLocationsNear:(CLLocation*)location {
+    
+    // The regions to monitor are picked from the local index until the user nears its edge
+    if ([_locationIndex coversLocation: location margin: _locationSyncFilter * 10]) {
+        [self monitorLocations: [_locationIndex locationsNearest: location limit: LOCATION_MONITOR_LIMIT]];
+        
+        // an old index is brought up to date with only what changed on the server
+        if (_locationIndex.token && [_clock.date timeIntervalSinceDate: _locationIndex.updated] > LOCATION_INDEX_REFRESH) {
+            [self refreshLocationIndex: _locationIndex];
+        }
+        
+        return;
+    }
+    
+    // one full fetch at a time, fixes that arrive meanwhile collapse into the latest
+    @synchronized(self) {
+        if (_locationFetching) {
+            _pendingLocationFetch = location;
+            return;
+        }
+        
+        _locationFetching = YES;
+    }
+    
+    CLLocationDistance radius = _locationSyncFilter * LOCATION_INDEX_SCALE;
+    
+    [self fetchLocationsNear: location radius: radius limit: LOCATION_INDEX_LIMIT since: nil success:^(NSArray* locations, NSArray* removed, id token) {
+        
+        @synchronized(self) {
+            [self useLocationIndex: [self locationIndexWithLocations: locations center: location radius: radius token: token]];
+        }
+        
+        [self finishLocationFetch];
+        
+    } failure:^(NSError *err) {
+        err = [QwasiError locationSyncFailed: err];
+        
+        [self emit: @"error", err];
+        
+        // offline, the last index is still the best guess
+        @synchronized(self) {
+            if (_locationIndex) {
+                [self monitorLocations: [_locationIndex locationsNearest: _lastFix ?: location limit: LOCATION_MONITOR_LIMIT]];
+            }
+        }
+        
+        [self finishLocationFetch];
+    }];
+}
+
+- (void)finishLocationFetch {
+    CLLocation* pending;
+    
+    @synchronized(self) {
+        _locationFetching = NO;
+        
+        pending = _pendingLocationFetch;
+        _pendingLocationFetch = nil;
+    }
+    
+    // the new index may already cover it, otherwise this fetches around it
+    if (pending) {
+        [self syncLocationsNear: pending];
+    }
+}
+
+- (void)refreshLocationIndex:(QwasiLocationIndex*)index {
+    
+    @synchronized(self) {
+        if (_locationRefreshing) {
+            return;
+        }
+        
+        _locationRefreshing = YES;
+    }
+    
+    [self fetchLocationsNear: index.center radius: index.radius limit: LOCATION_INDEX_LIMIT since: index.token success:^(NSArray* locations, NSArray* removed, id token) {
+        
+        @synchronized(self) {
+            _locationRefreshing = NO;
+            
+            // the user moved on and a full fetch replaced it meanwhile
+            if (_locationIndex != index) {
+                return;
+            }
+            
+            if (removed) {
+                [self useLocationIndex: [index indexByApplyingLocations: locations removedIds: removed token: token]];
+            }
+            else {
+                [self useLocationIndex: [self locationIndexWithLocations: locations center: index.center radius: index.radius token: token]];
+            }
+        }
+        
+    } failure:^(NSError *err) {
+        
+        // keep the index, the next sync will try again
+        @synchronized(self) {
+            _locationRefreshing = NO;
+        }
+        
+        [self emit: @"error", [QwasiError locationSyncFailed: err]];
+    }];
+}
+
+- (QwasiLocationIndex*)locationIndexWithLocations:(NSArray*)locations center:(CLLocation*)center radius:(CLLocationDistance)radius token:(id)token {
+    CLLocationDistance covered = radius;
+    
+    // a full set means the server cut it off, it is only complete up to the farthest result
+    if (locations.count >= LOCATION_INDEX_LIMIT) {
+        CLLocationDistance farthest = 0;
+        
+        for (QwasiLocation* loc in locations) {
+            if (loc.type != QwasiLocationTypeBeacon) {
+                farthest = MAX(farthest, [center distanceFromLocation: loc]);
+            }
+        }
+        
+        covered = MIN(covered, farthest);
+    }
+    
+    return [[QwasiLocationIndex alloc] initWithLocations: locations center: center radius: covered token: token];
+}
+
+- (void)useLocationIndex:(QwasiLocationIndex*)index {
+    index.updated = _clock.date;
+    
+    _locationIndex = index;
+    
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        [index writeToFile: [self locationIndexPath]];
+    });
+    
+    [self monitorLocations: [index locationsNearest: _lastFix ?: index.center limit: LOCATION_MONITOR_LIMIT]];
+}
+
+- (BOOL)location:(QwasiLocation*)location hasSameRegionAs:(QwasiLocation*)other {
+    
+    if (location.type != other.type) {
+        return NO;
+    }
+    
+    if (location.type == QwasiLocationTypeBeacon) {
+        return [location.beaconUUID isEqual: other.beaconUUID] &&
+            location.beaconMajorVersion == other.beaconMajorVersion &&
+            location.beaconMinorVersion == other.beaconMinorVersion;
+    }
+    
+    return location.latitude == other.latitude &&
+        location.longitude == other.longitude &&
+        location.geofenceRadius == other.geofenceRadius;
+}
+
+- (NSString*)locationIndexPath {
+    // kept beside the manager's state, so a manager with its own state gets its own index too
+    NSString* statePath = _locationManager.statePath ?: [QwasiLocationManager statePath];
+    
+    return [[statePath stringByDeletingLastPathComponent] stringByAppendingPathComponent: @"locations-index.json"];
+}
+
+- (QwasiLocationIndex*)loadLocationIndex {
+    QwasiLocationIndex* index = [QwasiLocationIndex indexWithContentsOfFile: [self locationIndexPath]];
+    
+    // locations change on the server, an old index is refetched rather than trusted unless it can be brought up to date
+    if (!index.token && [_clock.date timeIntervalSinceDate: index.updated] > LOCATION_INDEX_MAX_AGE) {
+        return nil;
+    }
+    
+    return index;
+}
+
+- (void)monitorLocations:(NSArray*)locations {
+    
+    // Only regions that changed are touched, retained ones keep their instance and dwell state but take the new record
+    NSMutableDictionary* current = [[NSMutableDictionary alloc] initWithCapacity: _locations.count];
+    NSMutableArray* monitored = [[NSMutableArray alloc] initWithCapacity: locations.count];
+    NSMutableArray* added = [[NSMutableArray alloc] init];
+    
+    for (QwasiLocation* location in _locations) {
+        current[location.id] = location;
+    }
+    
+    for (QwasiLocation* location in locations) {
+        QwasiLocation* existing = current[location.id];
+        
+        if (existing && [self location: existing hasSameRegionAs: location]) {
+            
+            // the server may still have changed the name, dwell interval or beacon proximity
+            if (location.data && ![existing.data isEqualToDictionary: location.data]) {
+                [_locationManager updateMonitoredLocation: existing withData: location.data];
+            }
+            
+            [monitored addObject: existing];
+            [current removeObjectForKey: location.id];
+        }
+        else if (location.id) {
+            [monitored addObject: location];
+            [added addObject: location];
+        }
+    }
+    
+    // what is left in current was dropped or redefined
+    for (QwasiLocation* location in current.allValues) {
+        [_locationManager stopMonitoringLocation: location];
+    }
+    
+    for (QwasiLocation* location in added) {
+        [_locationManager startMonitoringLocation: location];
+    }
+    
+    _locations = monitored;
+}
+
+- (void)fetchLocationsNear:(CLLocation*)location
+                   success:(void(^)(NSArray* locations))success
+                   failure:(void(^)(NSError* err))failure {
+    [self fetchLocationsNear: location radius: _locationSyncFilter * 10 limit: LOCATION_MONITOR_LIMIT success: success failure: failure];
+}
+
+- (void)fetchLocationsNear:(CLLocation*)location
+                    radius:(CLLocationDistance)radius
+                     limit:(NSUInteger)limit
+                   success:(void(^)(NSArray* locations))success
+                   failure:(void(^)(NSError* err))failure {
+    [self fetchLocationsNear: location radius: radius limit: limit since: nil success:^(NSArray* locations, NSArray* removed, id token) {
+        if (success) success(locations);
+    } failure: failure];
+}
+
+- (void)fetchLocationsNear:(CLLocation*)location
+                    radius:(CLLocationDistance)radius
+                     limit:(NSUInteger)limit
+                     since:(id)token
+                   success:(void(^)(NSArray* locations, NSArray* removed, id token))success
+                   failure:(void(^)(NSError* err))failure {
+    if (_registered) {
+        
+        // One background task covers every page
+        UIBackgroundTaskIdentifier bgTask = [[UIApplication sharedApplication] beginBackgroundTaskWithExpirationHandler: nil];
+        
+        NSDictionary* near = @{ @"lng": [NSNumber numberWithDouble: location.coordinate.longitude],
+                                @"lat": [NSNumber numberWithDouble: location.coordinate.latitude],
+                                @"radius": [NSNumber numberWithDouble: radius] };
+        
+        NSMutableArray* records = [[NSMutableArray alloc] init];
+        NSMutableArray* removed = [[NSMutableArray alloc] init];
         
+        [self fetchLocationPages: near limit: MAX(limit, 1) since: token cursor: nil records: records removed: removed completion:^(id next, BOOL delta, NSError* err) {
+            
+            if (err) {
+                err = [QwasiError locationFetchFailed: err];
+                
+                if (failure) failure(err);
+                
+                [self emit: @"error", err];
+            }
+            else if (success) {
+                NSArray* locations;
+                
+                @synchronized(self) {
+                    // monitored instances go last so they win, they carry dwell state
+                    NSArray* existing = [_locationIndex.locations ?: @[] arrayByAddingObjectsFromArray: _locations ?: @[]];
+                    
+                    locations = [self locationsWithRecords: records reusing: existing];
+                }
+                
+                success(locations, delta ? removed : nil, next);
+            }
+            
+            if (bgTask != UIBackgroundTaskInvalid) {
+                [[UIApplication sharedApplication] endBackgroundTask:bgTask];
+            }
+        }];
     }
     else {
         NSError* error = [QwasiError locationFetchFailed: [QwasiError deviceNotRegistered]];
@@ -1022,6 +1652,123 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
     }
 }
 
+- (void)fetchLocationPages:(NSDictionary*)near
+                     limit:(NSUInteger)limit
+                     since:(id)token
+                    cursor:(id)cursor
+                   records:(NSMutableArray*)records
+                   removed:(NSMutableArray*)removed
+                completion:(void(^)(id token, BOOL delta, NSError* err))completion {
+    
+    NSMutableDictionary* options = [[NSMutableDictionary alloc] init];
+    
+    // limit stays the total so a server without paging still returns everything in one go
+    options[@"schema"] = @"2.0";
+    options[@"page_size"] = [NSNumber numberWithUnsignedInteger: MIN(limit - records.count, LOCATION_FETCH_PAGE)];
+    
+    if (token) {
+        options[@"since"] = token;
+    }
+    
+    if (cursor) {
+        options[@"cursor"] = cursor;
+    }
+    
+    [_client invokeMethod: @"location.fetch"
+           withParameters: @{ @"near": near,
+                              @"options": options,
+                              @"limit": [NSNumber numberWithUnsignedInteger: limit - records.count] }
+                  success:^(AFHTTPRequestOperation *operation, id responseObject) {
+                      
+                      NSArray* values = nil;
+                      id next = nil;
+                      id latest = nil;
+                      BOOL delta = NO;
+                      
+                      if ([responseObject isKindOfClass: [NSDictionary class]]) {
+                          values = responseObject[@"value"];
+                          next = responseObject[@"cursor"];
+                          latest = responseObject[@"token"];
+                          
+                          // only a server that honored since sends deltas, anything else is the full set
+                          delta = token && [responseObject[@"delta"] boolValue];
+                          
+                          if ([responseObject[@"removed"] isKindOfClass: [NSArray class]]) {
+                              [removed addObjectsFromArray: responseObject[@"removed"]];
+                          }
+                      }
+                      
+                      if (![values isKindOfClass: [NSArray class]]) {
+                          values = @[];
+                      }
+                      
+                      if ([next isKindOfClass: [NSNull class]]) {
+                          next = nil;
+                      }
+                      
+                      if ([latest isKindOfClass: [NSNull class]]) {
+                          latest = nil;
+                      }
+                      
+                      [records addObjectsFromArray: values];
+                      
+                      if (next && values.count > 0 && records.count < limit) {
+                          [self fetchLocationPages: near limit: limit since: token cursor: next records: records removed: removed completion:^(id last, BOOL more, NSError* err) {
+                              completion(last ?: latest, delta && more, err);
+                          }];
+                      }
+                      else {
+                          completion(latest, delta, nil);
+                      }
+                      
+                  } failure:^(AFHTTPRequestOperation *operation, NSError *error) {
+                      
+                      completion(nil, NO, error);
+                  }];
+}
+
+- (NSArray*)locationsWithRecords:(NSArray*)records reusing:(NSArray*)existing {
+    NSMutableDictionary* known = [[NSMutableDictionary alloc] initWithCapacity: existing.count];
+    NSMutableArray* locations = [[NSMutableArray alloc] initWithCapacity: records.count];
+    NSUInteger ignored = 0;
+    
+    for (QwasiLocation* location in existing) {
+        if (location.id && location.data) {
+            known[location.id] = location;
+        }
+    }
+    
+    for (NSDictionary* data in records) {
+        if (![data isKindOfClass: [NSDictionary class]]) {
+            continue;
+        }
+        
+        // an unchanged record keeps its instance, there is nothing to reparse
+        QwasiLocation* location = known[data[@"id"]];
+        
+        if (!location || ![location.data isEqual: data]) {
+            location = [[QwasiLocation alloc] initWithLocationData: data];
+        }
+        
+        if ((location.type != QwasiLocationTypeBeacon) ||
+            [location.vendor isEqualToString: @"ibeacon"]) {
+            
+            [locations addObject: location];
+        }
+        else {
+            ignored++;
+        }
+    }
+    
+    NSLog(@"Fetched %lu locations from server.", (unsigned long)locations.count);
+    
+    if (ignored > 0) {
+        NSLog(@"Ignoring %lu unsupported locations.", (unsigned long)ignored);
+    }
+    
+    return locations;
+}
+
 - (void)subscribeToChannel:(NSString*)channel {
     [self subscribeToChannel: channel success: nil failure: nil];
 }
@@ -1347,44 +2094,25 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
             failure:(void(^)(NSError* err))failure {
     if (_registered) {
         
-        id payload = message.payload;
+        NSError* jsonError;
+        
+        NSMutableDictionary* params = [self sendParametersForMessage: message error: &jsonError];
         
-        if (payload) {
+        if (jsonError) {
             
-            if ([NSJSONSerialization isValidJSONObject: payload]) {
-                NSError* jsonError;
-                
-                NSData* jsonData = [NSJSONSerialization dataWithJSONObject: message.payload options: 0 error: &jsonError];
-                
-                if (!jsonData || jsonError) {
-                    
-                    jsonError = [QwasiError sendMessageToUserToken: userToken failed: jsonError];
-                    
-                    if (failure) failure(jsonError);
-                    
-                    [self emit: @"error", jsonError];
-                    
-                    return;
-                }
-                
-                payload = [jsonData base64EncodedStringWithOptions:0];
-                
-            }
-            else if ([payload isKindOfClass: [NSString class]]) {
-                NSData* jsonData = [payload dataUsingEncoding: NSUTF8StringEncoding];
-                payload = [jsonData base64EncodedStringWithOptions: 0];
-            }
-            else {
-                payload = nil;
-            }
+            jsonError = [QwasiError sendMessageToUserToken: userToken failed: jsonError];
+            
+            if (failure) failure(jsonError);
+            
+            [self emit: @"error", jsonError];
+            
+            return;
         }
         
+        params[@"audience"] = @{ @"user_tokens": @[userToken] };
+        
         [_client invokeMethod: @"message.send"
-               withParameters: @{ @"audience": @{ @"user_tokens": @[userToken] },
-                                  @"notification": message.alert,
-                                  @"payload": payload,
-                                  @"payload_type": message.payloadType,
-                                  @"tags": message.tags }
+               withParameters: params
                       success:^(AFHTTPRequestOperation *operation, id responseObject) {
                           
                           if (success) {
@@ -1412,6 +2140,179 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
     }
 }
 
+- (NSMutableDictionary*)sendParametersForMessage:(QwasiMessage*)message error:(NSError**)error {
+    
+    NSMutableDictionary* params = [[NSMutableDictionary alloc] init];
+    NSData* payloadData = nil;
+    id payload = message.payload;
+    
+    if (payload) {
+        
+        if ([NSJSONSerialization isValidJSONObject: payload]) {
+            
+            payloadData = [NSJSONSerialization dataWithJSONObject: payload options: 0 error: error];
+        }
+        else if ([payload isKindOfClass: [NSString class]]) {
+            payloadData = [payload dataUsingEncoding: NSUTF8StringEncoding];
+        }
+    }
+    
+    // large payloads go over the wire gzipped when enabled, older receivers can't inflate them
+    if (_compressPayloads && payloadData.length >= SEND_COMPRESS_THRESHOLD) {
+        NSData* compressed = [QwasiMessage compressPayloadData: payloadData];
+        
+        if (compressed && compressed.length < payloadData.length) {
+            payloadData = compressed;
+            params[@"payload_encoding"] = @"gzip";
+        }
+    }
+    
+    params[@"notification"] = message.alert;
+    params[@"payload"] = [payloadData base64EncodedStringWithOptions: 0];
+    params[@"payload_type"] = message.payloadType;
+    params[@"tags"] = message.tags;
+    
+    return params;
+}
+
+- (void)sendMessage:(QwasiMessage*)message
+         toAudience:(NSDictionary*)audience
+            success:(void(^)(NSArray* results))success
+            failure:(void(^)(NSError* err))failure {
+    if (_registered) {
+        
+        NSError* jsonError;
+        
+        // encoded once for every chunk
+        NSDictionary* params = [self sendParametersForMessage: message error: &jsonError];
+        
+        NSMutableArray* recipients = [[NSMutableArray alloc] init];
+        
+        for (NSString* key in @[ @"user_tokens", @"channels", @"devices" ]) {
+            for (NSString* recipient in audience[key]) {
+                [recipients addObject: @[ key, recipient ]];
+            }
+        }
+        
+        if (jsonError || recipients.count == 0) {
+            
+            jsonError = [QwasiError sendMessageToRecipients: recipients.count failed: jsonError];
+            
+            if (failure) failure(jsonError);
+            
+            [self emit: @"error", jsonError];
+            
+            return;
+        }
+        
+        NSMutableArray* chunks = [[NSMutableArray alloc] init];
+        
+        for (NSUInteger i = 0; i < recipients.count; i += SEND_AUDIENCE_CHUNK) {
+            NSMutableDictionary* chunk = [[NSMutableDictionary alloc] init];
+            
+            for (NSArray* recipient in [recipients subarrayWithRange: NSMakeRange(i, MIN(SEND_AUDIENCE_CHUNK, recipients.count - i))]) {
+                if (!chunk[recipient[0]]) {
+                    chunk[recipient[0]] = [[NSMutableArray alloc] init];
+                }
+                
+                [chunk[recipient[0]] addObject: recipient[1]];
+            }
+            
+            [chunks addObject: chunk];
+        }
+        
+        NSMutableArray* results = [[NSMutableArray alloc] initWithCapacity: chunks.count];
+        
+        for (NSUInteger i = 0; i < chunks.count; i++) {
+            [results addObject: [NSNull null]];
+        }
+        
+        UIBackgroundTaskIdentifier bgTask = [[UIApplication sharedApplication] beginBackgroundTaskWithExpirationHandler: nil];
+        
+        __block NSUInteger next = 0;
+        __block NSUInteger pending = chunks.count;
+        __block NSUInteger failedCount = 0;
+        __block NSError* lastError = nil;
+        __block void (^sendNext)(void);
+        
+        // keep a few chunks in flight, each completion starts the next one
+        sendNext = ^{
+            if (next >= chunks.count) {
+                return;
+            }
+            
+            NSUInteger index = next++;
+            NSDictionary* chunk = chunks[index];
+            NSMutableDictionary* chunkParams = [params mutableCopy];
+            
+            chunkParams[@"audience"] = chunk;
+            
+            void (^finished)(void) = ^{
+                if (--pending > 0) {
+                    sendNext();
+                    return;
+                }
+                
+                sendNext = nil;
+                
+                if (lastError) {
+                    NSError* error = [QwasiError sendMessageToRecipients: failedCount failed: lastError];
+                    
+                    if (failure) failure(error);
+                    
+                    [self emit: @"error", error];
+                }
+                else if (success) {
+                    success(results);
+                }
+                
+                if (bgTask != UIBackgroundTaskInvalid) {
+                    [[UIApplication sharedApplication] endBackgroundTask:bgTask];
+                }
+            };
+            
+            [_client invokeMethod: @"message.send"
+                   withParameters: chunkParams
+                          success:^(AFHTTPRequestOperation *operation, id responseObject) {
+                              
+                              if (responseObject) results[index] = responseObject;
+                              
+                              finished();
+                              
+                          } failure:^(AFHTTPRequestOperation *operation, NSError *error) {
+                              
+                              for (NSArray* ids in [chunk allValues]) {
+                                  failedCount += ids.count;
+                              }
+                              
+                              lastError = error;
+                              
+                              finished();
+                          }];
+        };
+        
+        for (NSUInteger i = 0; i < MIN(SEND_MAX_CONCURRENT, chunks.count); i++) {
+            sendNext();
+        }
+    }
+    else {
+        NSError* error = [QwasiError sendMessageToRecipients: 0 failed: [QwasiError deviceNotRegistered]];
+        
+        if (failure) {
+            failure(error);
+        }
+        
+        [self emit: @"error", error];
+    }
+}
+
+- (void)sendMessage:(QwasiMessage*)message
+       toUserTokens:(NSArray*)userTokens
+            success:(void(^)(NSArray* results))success
+            failure:(void(^)(NSError* err))failure {
+    [self sendMessage: message toAudience: @{ @"user_tokens": userTokens ?: @[] } success: success failure: failure];
+}
+
 - (NSArray*)channels {
     return [NSArray arrayWithArray: _channels];
 }
@@ -0,0 +1,76 @@
+//
+//  QwasiBeaconRanger.h
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+
+@class QwasiLocation;
+
+typedef NS_ENUM(NSInteger, QwasiBeaconDecision) {
+    QwasiBeaconDecisionNone = 0,
+    QwasiBeaconDecisionEnter,
+    QwasiBeaconDecisionExit
+};
+
+/** Turns raw ranging callbacks into enter and exit decisions. Each beacon location keeps a Kalman
+ filtered distance, and a decision needs several readings on the far side of a hysteresis band, so a
+ single noisy reading no longer flips the location in and out. */
+@interface QwasiBeaconRanger : NSObject
+
+/** Readings needed inside the proximity before entering, default 2 */
+@property (nonatomic,readwrite) NSUInteger enterReadings;
+
+/** Readings needed past exitFactor times the proximity, or without the beacon, before exiting, default 5 */
+@property (nonatomic,readwrite) NSUInteger exitReadings;
+
+/** Width of the hysteresis band as a multiple of the proximity, default 1.5 */
+@property (nonatomic,readwrite) double exitFactor;
+
+/** Readings clear of the band before the location is considered stable and ranging can rest, default 10 */
+@property (nonatomic,readwrite) NSUInteger stableReadings;
+
+/** How long ranging rests once stable, default 30 seconds */
+@property (nonatomic,readwrite) NSTimeInterval restInterval;
+
+/** Merges one ranging callback, the nearest beacon with a known accuracy is used */
+- (QwasiBeaconDecision)updateLocation:(QwasiLocation*)location withBeacons:(NSArray*)beacons;
+
+/** distance below 0 is a reading without the beacon, time is seconds on any monotonic clock */
+- (QwasiBeaconDecision)updateLocation:(QwasiLocation*)location distance:(CLLocationDistance)distance at:(NSTimeInterval)time;
+
+/** Filtered distance in meters, or -1 before the first reading */
+- (CLLocationDistance)distanceForLocation:(QwasiLocation*)location;
+
+/** YES once the decision has held long enough that ranging can be paused for restInterval */
+- (BOOL)isStableLocation:(QwasiLocation*)location;
+
+/** Clears the stable count after ranging resumes, the filtered distance is kept */
+- (void)resumeLocation:(QwasiLocation*)location;
+
+- (void)removeLocation:(QwasiLocation*)location;
+@end
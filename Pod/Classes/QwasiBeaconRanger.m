@@ -0,0 +1,178 @@
+//
+//  QwasiBeaconRanger.m
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "QwasiBeaconRanger.h"
+#import "QwasiLocation.h"
+
+// variance added per second, about how far someone walking drifts
+#define BEACON_PROCESS_NOISE 0.5
+// reported accuracy gets noisier the further away the beacon is
+#define BEACON_MEASUREMENT_NOISE 0.25
+
+@interface QwasiBeaconTrack : NSObject {
+@public
+    double _estimate;
+    double _variance;
+    NSTimeInterval _updated;
+    
+    BOOL _inside;
+    NSUInteger _pending;
+    NSUInteger _stable;
+}
+@end
+
+@implementation QwasiBeaconTrack
+@end
+
+@implementation QwasiBeaconRanger {
+    NSMutableDictionary* _tracks;
+}
+
+- (id)init {
+    if (self = [super init]) {
+        _tracks = [[NSMutableDictionary alloc] init];
+        
+        _enterReadings = 2;
+        _exitReadings = 5;
+        _exitFactor = 1.5;
+        _stableReadings = 10;
+        _restInterval = 30;
+    }
+    return self;
+}
+
+- (QwasiBeaconDecision)updateLocation:(QwasiLocation*)location withBeacons:(NSArray*)beacons {
+    CLLocationDistance nearest = -1;
+    
+    // CoreLocation reports -1 when it can't tell, that counts as a missed reading
+    for (CLBeacon* beacon in beacons) {
+        if (beacon.accuracy > 0 && (nearest < 0 || beacon.accuracy < nearest)) {
+            nearest = beacon.accuracy;
+        }
+    }
+    
+    return [self updateLocation: location distance: nearest at: [[NSProcessInfo processInfo] systemUptime]];
+}
+
+- (QwasiBeaconDecision)updateLocation:(QwasiLocation*)location distance:(CLLocationDistance)distance at:(NSTimeInterval)time {
+    
+    @synchronized(self) {
+        QwasiBeaconTrack* track = _tracks[location.id];
+        CLLocationDistance enter = location.beaconProximity;
+        CLLocationDistance exit = enter * _exitFactor;
+        
+        if (!track) {
+            track = [[QwasiBeaconTrack alloc] init];
+            track->_estimate = -1;
+            
+            _tracks[location.id] = track;
+        }
+        
+        if (distance > 0) {
+            double noise = BEACON_MEASUREMENT_NOISE * distance;
+            double r = noise * noise + 1;
+            
+            if (track->_estimate < 0) {
+                track->_estimate = distance;
+                track->_variance = r;
+            }
+            else {
+                track->_variance += BEACON_PROCESS_NOISE * MAX(time - track->_updated, 0);
+                
+                double gain = track->_variance / (track->_variance + r);
+                
+                track->_estimate += gain * (distance - track->_estimate);
+                track->_variance *= (1 - gain);
+            }
+            
+            track->_updated = time;
+        }
+        
+        BOOL in = distance > 0 && track->_estimate <= enter;
+        BOOL out = distance <= 0 || track->_estimate > exit;
+        QwasiBeaconDecision decision = QwasiBeaconDecisionNone;
+        
+        if (track->_inside ? out : in) {
+            track->_pending++;
+            track->_stable = 0;
+            
+            if (track->_pending >= (track->_inside ? _exitReadings : _enterReadings)) {
+                track->_inside = !track->_inside;
+                track->_pending = 0;
+                
+                decision = track->_inside ? QwasiBeaconDecisionEnter : QwasiBeaconDecisionExit;
+            }
+        }
+        else {
+            track->_pending = 0;
+            
+            // inside the band either way could still tip, only count readings clear of it
+            if (distance > 0 && (track->_estimate <= enter || track->_estimate > exit)) {
+                track->_stable++;
+            }
+            else {
+                track->_stable = 0;
+            }
+        }
+        
+        return decision;
+    }
+}
+
+- (CLLocationDistance)distanceForLocation:(QwasiLocation*)location {
+    @synchronized(self) {
+        QwasiBeaconTrack* track = _tracks[location.id];
+        
+        return track ? track->_estimate : -1;
+    }
+}
+
+- (BOOL)isStableLocation:(QwasiLocation*)location {
+    @synchronized(self) {
+        QwasiBeaconTrack* track = _tracks[location.id];
+        
+        return track && track->_stable >= _stableReadings;
+    }
+}
+
+- (void)resumeLocation:(QwasiLocation*)location {
+    @synchronized(self) {
+        QwasiBeaconTrack* track = _tracks[location.id];
+        
+        if (track) {
+            track->_stable = 0;
+        }
+    }
+}
+
+- (void)removeLocation:(QwasiLocation*)location {
+    @synchronized(self) {
+        [_tracks removeObjectForKey: location.id];
+    }
+}
+@end
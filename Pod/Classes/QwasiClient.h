@@ -36,6 +36,8 @@
 
 + (instancetype)clientWithConfig:(QwasiConfig*)config;
 
+- (id)initWithConfig:(QwasiConfig*)config;
+
 - (void)invokeMethod:(NSString *)method
       withParameters:(id)parameters
                retry:(BOOL)retry
@@ -0,0 +1,83 @@
+//
+//  QwasiClock.m
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "QwasiClock.h"
+
+#import <mach/mach_time.h>
+
+@implementation QwasiClock
+
++ (instancetype)systemClock {
+    static dispatch_once_t once;
+    static id sharedInstance = nil;
+    
+    dispatch_once(&once, ^{
+        sharedInstance = [[QwasiClock alloc] init];
+    });
+    
+    return sharedInstance;
+}
+
+- (NSTimeInterval)uptime {
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t once;
+    
+    dispatch_once(&once, ^{
+        mach_timebase_info(&timebase);
+    });
+    
+    return (double)mach_absolute_time() * timebase.numer / timebase.denom / NSEC_PER_SEC;
+}
+
+- (NSDate*)date {
+    return [NSDate date];
+}
+
+- (id)scheduleAfter:(NSTimeInterval)delay leeway:(NSTimeInterval)leeway queue:(dispatch_queue_t)queue block:(dispatch_block_t)block {
+    dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+    
+    dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(MAX(delay, 0) * NSEC_PER_SEC)), DISPATCH_TIME_FOREVER, (uint64_t)(MAX(leeway, 0) * NSEC_PER_SEC));
+    
+    // one shot, cancelling releases the handler and with it the timer
+    dispatch_source_set_event_handler(timer, ^{
+        dispatch_source_cancel(timer);
+        
+        block();
+    });
+    
+    dispatch_resume(timer);
+    
+    return timer;
+}
+
+- (void)cancelTimer:(id)timer {
+    if (timer) {
+        dispatch_source_cancel(timer);
+    }
+}
+@end
@@ -0,0 +1,52 @@
+//
+//  QwasiDwellScheduler.h
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import <Foundation/Foundation.h>
+
+#import "QwasiClock.h"
+
+@class QwasiLocation;
+
+/** One timer for every location's dwell and exit checks. Deadlines are kept in a min-heap on a
+ monotonic clock and everything due within the leeway is handled in the same wakeup. */
+@interface QwasiDwellScheduler : NSObject
+
+@property (nonatomic,readonly) QwasiClock* clock;
+
+/** How far past its deadline an event may be batched with an earlier one, default 1 second */
+@property (nonatomic,readwrite) NSTimeInterval leeway;
+
+/** Used by locations that aren't owned by a location manager */
++ (instancetype)defaultScheduler;
+
+/** Deadlines are kept on the clock's uptime, init uses the system clock */
+- (id)initWithClock:(QwasiClock*)clock;
+
+/** Replaces any pending check for the location */
+- (void)scheduleLocation:(QwasiLocation*)location after:(NSTimeInterval)delay;
+@end
@@ -0,0 +1,223 @@
+//
+//  QwasiDwellScheduler.m
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "QwasiDwellScheduler.h"
+#import "QwasiLocation.h"
+
+#define DWELL_SCHEDULER_LEEWAY 1.0
+
+@interface QwasiLocation (Dwell)
+- (NSTimeInterval)dwellTimerFired;
+@end
+
+typedef struct {
+    NSTimeInterval due;
+    uint64_t generation;
+} QwasiDwellEntry;
+
+@implementation QwasiDwellScheduler {
+    dispatch_queue_t _queue;
+    id _timer;
+    
+    QwasiDwellEntry* _heap;
+    NSUInteger _count;
+    NSUInteger _capacity;
+    
+    // generation -> location for live entries, heap entries without one were cancelled or replaced
+    NSMutableDictionary* _live;
+    NSMapTable* _generations;
+    uint64_t _generation;
+    NSTimeInterval _armedFor;
+}
+
++ (instancetype)defaultScheduler {
+    static QwasiDwellScheduler* sharedInstance = nil;
+    static dispatch_once_t onceToken;
+    
+    dispatch_once(&onceToken, ^{
+        sharedInstance = [[QwasiDwellScheduler alloc] init];
+    });
+    
+    return sharedInstance;
+}
+
+- (id)init {
+    return [self initWithClock: [QwasiClock systemClock]];
+}
+
+- (id)initWithClock:(QwasiClock*)clock {
+    if (self = [super init]) {
+        _clock = clock;
+        _leeway = DWELL_SCHEDULER_LEEWAY;
+        _queue = dispatch_queue_create("com.qwasi.dwell", DISPATCH_QUEUE_SERIAL);
+        _live = [[NSMutableDictionary alloc] init];
+        _generations = [NSMapTable mapTableWithKeyOptions: NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality
+                                             valueOptions: NSPointerFunctionsStrongMemory];
+        _armedFor = DBL_MAX;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [_clock cancelTimer: _timer];
+    
+    free(_heap);
+}
+
+#pragma mark - Heap
+- (void)push:(QwasiDwellEntry)entry {
+    if (_count == _capacity) {
+        _capacity = MAX(_capacity * 2, 16);
+        _heap = realloc(_heap, _capacity * sizeof(QwasiDwellEntry));
+    }
+    
+    NSUInteger i = _count++;
+    
+    while (i > 0) {
+        NSUInteger parent = (i - 1) / 2;
+        
+        if (_heap[parent].due <= entry.due) break;
+        
+        _heap[i] = _heap[parent];
+        i = parent;
+    }
+    
+    _heap[i] = entry;
+}
+
+- (QwasiDwellEntry)pop {
+    QwasiDwellEntry top = _heap[0];
+    QwasiDwellEntry last = _heap[--_count];
+    NSUInteger i = 0;
+    
+    while (YES) {
+        NSUInteger child = i * 2 + 1;
+        
+        if (child >= _count) break;
+        
+        if (child + 1 < _count && _heap[child + 1].due < _heap[child].due) child++;
+        
+        if (last.due <= _heap[child].due) break;
+        
+        _heap[i] = _heap[child];
+        i = child;
+    }
+    
+    if (_count > 0) {
+        _heap[i] = last;
+    }
+    
+    return top;
+}
+
+#pragma mark - Scheduling
+- (void)scheduleLocation:(QwasiLocation*)location after:(NSTimeInterval)delay {
+    dispatch_async(_queue, ^{
+        [self enqueue: location due: _clock.uptime + MAX(delay, 0)];
+        [self rearm];
+    });
+}
+
+- (void)remove:(QwasiLocation*)location {
+    NSNumber* generation = [_generations objectForKey: location];
+    
+    if (generation) {
+        [_live removeObjectForKey: generation];
+        [_generations removeObjectForKey: location];
+    }
+}
+
+- (void)enqueue:(QwasiLocation*)location due:(NSTimeInterval)due {
+    QwasiDwellEntry entry = { due, ++_generation };
+    NSNumber* generation = [NSNumber numberWithUnsignedLongLong: entry.generation];
+    
+    [self remove: location];
+    
+    _live[generation] = location;
+    [_generations setObject: generation forKey: location];
+    
+    [self push: entry];
+}
+
+- (void)rearm {
+    // drop cancelled and superseded entries off the top
+    while (_count > 0 && !_live[[NSNumber numberWithUnsignedLongLong: _heap[0].generation]]) {
+        [self pop];
+    }
+    
+    if (_count == 0) {
+        [_clock cancelTimer: _timer];
+        _timer = nil;
+        _armedFor = DBL_MAX;
+        return;
+    }
+    
+    NSTimeInterval due = _heap[0].due;
+    
+    if (due != _armedFor) {
+        __weak QwasiDwellScheduler* weakSelf = self;
+        
+        [_clock cancelTimer: _timer];
+        
+        _timer = [_clock scheduleAfter: due - _clock.uptime leeway: _leeway queue: _queue block: ^{
+            [weakSelf fire];
+        }];
+        _armedFor = due;
+    }
+}
+
+- (void)fire {
+    NSTimeInterval now = _clock.uptime;
+    NSMutableArray* due = [[NSMutableArray alloc] init];
+    
+    _timer = nil;
+    _armedFor = DBL_MAX;
+    
+    // everything due within the leeway rides along on this wakeup
+    while (_count > 0 && _heap[0].due <= now + _leeway) {
+        QwasiDwellEntry entry = [self pop];
+        QwasiLocation* location = _live[[NSNumber numberWithUnsignedLongLong: entry.generation]];
+        
+        if (location) {
+            [due addObject: location];
+            [self remove: location];
+        }
+    }
+    
+    for (QwasiLocation* location in due) {
+        NSTimeInterval next = [location dwellTimerFired];
+        
+        // a location scheduled again from inside its own callback keeps that schedule
+        if (next > 0 && ![_generations objectForKey: location]) {
+            [self enqueue: location due: now + next];
+        }
+    }
+    
+    [self rearm];
+}
+@end
@@ -142,6 +142,10 @@ typedef NS_ENUM(NSInteger, QwasiErrorCode) {
  @param userToken the usertoken the message could not be delivered to.
  @param reason Underlying error data. */
 + (NSError*)sendMessageToUserToken:(NSString*)userToken failed:(NSError*)reason;
+/** Bulk send message failed for part of the audience.
+ @param count the number of recipients the message could not be delivered to.
+ @param reason Underlying error data. */
++ (NSError*)sendMessageToRecipients:(NSUInteger)count failed:(NSError*)reason;
 + (NSError*)channel:(NSString*)channel subscribeFailed:(NSError*)reason;
 + (NSError*)channel:(NSString*)channel unsubscribeFailed:(NSError*)reason;
 + (NSError*)location:(QwasiLocation*)location monitoringFailed:(NSError*)reason;
@@ -147,6 +147,12 @@ NSString* const kQwasiErrorDomain = @"com.qwasi.sdk";
                 withInnerError: reason];
 }
 
++ (NSError*)sendMessageToRecipients:(NSUInteger)count failed:(NSError*)reason {
+    return [self errorWithCode: QwasiErrorSendMessageFailed
+                   withMessage: [NSString stringWithFormat: @"Failed to send message to %lu recipients.", (unsigned long)count]
+                withInnerError: reason];
+}
+
 + (NSError*)postEvent:(NSString*)event failedWithReason:(NSError*)reason {
     return [self errorWithCode: QwasiErrorPostEventFailed withMessage: [NSString stringWithFormat: @"Post event %@ failed.", event] withInnerError: reason];
 }
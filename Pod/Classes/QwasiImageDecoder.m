@@ -0,0 +1,132 @@
+//
+//  QwasiImageDecoder.m
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "QwasiImageDecoder.h"
+#import <ImageIO/ImageIO.h>
+
+#define IMAGE_CACHE_COST_LIMIT 32 * 1024 * 1024
+
+@implementation QwasiImageDecoder {
+    NSCache* _cache;
+}
+
++ (instancetype)shared {
+    static dispatch_once_t once;
+    static id sharedInstance = nil;
+    
+    dispatch_once(&once, ^{
+        sharedInstance = [[QwasiImageDecoder alloc] init];
+    });
+    
+    return sharedInstance;
+}
+
+- (id)init {
+    if (self = [super init]) {
+        _cache = [[NSCache alloc] init];
+        _cache.name = @"com.qwasi.image.cache";
+        _cache.totalCostLimit = IMAGE_CACHE_COST_LIMIT;
+    }
+    return self;
+}
+
+- (NSUInteger)totalCostLimit {
+    return _cache.totalCostLimit;
+}
+
+- (void)setTotalCostLimit:(NSUInteger)totalCostLimit {
+    _cache.totalCostLimit = totalCostLimit;
+}
+
+- (NSString*)cacheKey:(NSString*)key maxPixelSize:(CGFloat)maxPixelSize {
+    return [NSString stringWithFormat: @"%@@%.0f", key, maxPixelSize];
+}
+
+- (UIImage*)cachedImageForKey:(NSString*)key maxPixelSize:(CGFloat)maxPixelSize {
+    if (!key) {
+        return nil;
+    }
+    
+    return [_cache objectForKey: [self cacheKey: key maxPixelSize: maxPixelSize]];
+}
+
+- (UIImage*)imageWithData:(NSData*)data maxPixelSize:(CGFloat)maxPixelSize forKey:(NSString*)key {
+    
+    UIImage* image = [self cachedImageForKey: key maxPixelSize: maxPixelSize];
+    
+    if (image || !data) {
+        return image;
+    }
+    
+    CGImageSourceRef source = CGImageSourceCreateWithData((__bridge CFDataRef)data, NULL);
+    
+    if (!source) {
+        return nil;
+    }
+    
+    CGFloat pixelSize = maxPixelSize;
+    
+    if (pixelSize <= 0) {
+        // Full size, but still go through the thumbnail path so orientation is applied
+        NSDictionary* properties = CFBridgingRelease(CGImageSourceCopyPropertiesAtIndex(source, 0, NULL));
+        
+        pixelSize = MAX([properties[(__bridge NSString*)kCGImagePropertyPixelWidth] doubleValue],
+                           [properties[(__bridge NSString*)kCGImagePropertyPixelHeight] doubleValue]);
+    }
+    
+    // Decode the bitmap now, on the calling thread, rather than lazily at first render
+    NSDictionary* options = @{ (__bridge NSString*)kCGImageSourceCreateThumbnailFromImageAlways: @YES,
+                               (__bridge NSString*)kCGImageSourceCreateThumbnailWithTransform: @YES,
+                               (__bridge NSString*)kCGImageSourceShouldCacheImmediately: @YES,
+                               (__bridge NSString*)kCGImageSourceThumbnailMaxPixelSize: [NSNumber numberWithDouble: pixelSize] };
+    
+    CGImageRef imageRef = (pixelSize > 0) ? CGImageSourceCreateThumbnailAtIndex(source, 0, (__bridge CFDictionaryRef)options) : NULL;
+    
+    CFRelease(source);
+    
+    if (!imageRef) {
+        return nil;
+    }
+    
+    image = [UIImage imageWithCGImage: imageRef scale: 1.0 orientation: UIImageOrientationUp];
+    
+    if (key) {
+        NSUInteger cost = CGImageGetBytesPerRow(imageRef) * CGImageGetHeight(imageRef);
+        
+        [_cache setObject: image forKey: [self cacheKey: key maxPixelSize: maxPixelSize] cost: cost];
+    }
+    
+    CGImageRelease(imageRef);
+    
+    return image;
+}
+
+- (void)removeAllImages {
+    [_cache removeAllObjects];
+}
+@end
@@ -63,6 +63,9 @@ typedef NS_ENUM(NSInteger, QwasiLocationState) {
 @property (nonatomic,readonly) CLRegion* region;
 @property (nonatomic,readonly) CLBeacon* beacon;
 
+/** The server record this location was built from, nil for raw fixes */
+@property (nonatomic,readonly) NSDictionary* data;
+
 - (id)initWithLocation:(CLLocation*)location;
 - (id)initWithLocationData:(NSDictionary*)data;
 
@@ -70,4 +73,10 @@ typedef NS_ENUM(NSInteger, QwasiLocationState) {
 - (void)enterWithBeacon:(CLBeacon*)beacon;
 - (void)exit;
 - (void)exitWithBeacon:(CLBeacon*)beacon;
+
+/** Resumes inside state saved by a previous launch without emitting enter again */
+- (void)restoreInsideSince:(NSDate*)dwellStart;
+
+/** Takes name, dwell interval and beacon settings from a newer record of the same region, keeping dwell state */
+- (void)updateWithLocationData:(NSDictionary*)data;
 @end
\ No newline at end of file
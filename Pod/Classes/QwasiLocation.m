@@ -28,14 +28,28 @@
 
 #import "QwasiLocation.h"
 #import "QwasiLocationManager.h"
+#import "QwasiDwellScheduler.h"
 
 #import <objc/runtime.h>
 
+// dwell times follow the manager's clock, so a replay can run them in virtual time
+static NSTimeInterval QwasiLocationNow(void) {
+    QwasiClock* clock = [QwasiLocationManager currentManager].clock ?: [QwasiClock systemClock];
+    
+    return clock.date.timeIntervalSinceReferenceDate;
+}
+
 @implementation QwasiLocation {
+    // built on first use for raw fixes, which mostly never need them
+    NSString* _id;
+    NSString* _name;
+    CLRegion* _region;
+    
     NSTimeInterval _dwellInterval;
     NSTimeInterval _dwellStart;
     NSTimeInterval _dwellExit;
-    dispatch_source_t _dwellTimer;
+    NSTimeInterval _timerInterval;
+    BOOL _dwellScheduled;
     
     double _dwellTic;
     
@@ -55,10 +69,7 @@
                                    speed: location.speed
                                timestamp: location.timestamp]) {
         
-        _id = [NSString stringWithFormat: @"%lu", (unsigned long)self.hash];
-        _name = [NSString stringWithFormat: @"CLLocation_%lu", (unsigned long)self.hash];
         _type = QwasiLocationTypeCoordinate;
-        _region = [[CLCircularRegion alloc] initWithCenter: self.coordinate radius: 0 identifier: _id];
         _state = QwasiLocationStateUnknown;
         _exit = NO;
     }
@@ -83,6 +94,7 @@
     }
     
     if (self = [super initWithLatitude: [coord[1] doubleValue] longitude: [coord[0] doubleValue]]) {
+        _data = data;
         _id = data[@"id"];
         
         _name = data[@"name"];
@@ -149,6 +161,36 @@
     }
 }
 
+- (NSString*)id {
+    @synchronized(self) {
+        if (!_id && _type == QwasiLocationTypeCoordinate) {
+            _id = [NSString stringWithFormat: @"%lu", (unsigned long)self.hash];
+        }
+        
+        return _id;
+    }
+}
+
+- (NSString*)name {
+    @synchronized(self) {
+        if (!_name && _type == QwasiLocationTypeCoordinate) {
+            _name = [NSString stringWithFormat: @"CLLocation_%lu", (unsigned long)self.hash];
+        }
+        
+        return _name;
+    }
+}
+
+- (CLRegion*)region {
+    @synchronized(self) {
+        if (!_region && _type == QwasiLocationTypeCoordinate) {
+            _region = [[CLCircularRegion alloc] initWithCenter: self.coordinate radius: 0 identifier: self.id];
+        }
+        
+        return _region;
+    }
+}
+
 - (CLLocationDegrees)longitude {
     return self.coordinate.longitude;
 }
@@ -160,8 +202,8 @@
 - (NSString*)description {
     NSMutableDictionary* desc = [[NSMutableDictionary alloc] init];
     
-    desc[@"id"] = _id;
-    desc[@"name"] = _name;
+    desc[@"id"] = self.id;
+    desc[@"name"] = self.name;
     desc[@"region"] = [super description];
     
     switch (_type) {
@@ -207,7 +249,7 @@
             
             if (!_dwell) {
                 
-                _dwellStart = [NSDate timeIntervalSinceReferenceDate];
+                _dwellStart = QwasiLocationNow();
                 
                 _dwellExit = 0;
                 
@@ -224,53 +266,87 @@
 - (void)dwell {
     
     @synchronized(self) {
-        if (_inside && !_dwellTimer) {
+        // locations outside any manager still need their dwell and exit checks
+        QwasiDwellScheduler* scheduler = [QwasiLocationManager currentManager].dwellScheduler ?: [QwasiDwellScheduler defaultScheduler];
+        
+        if (_inside && !_dwellScheduled) {
             // How often the event will be fired, up to _dwellInterval
-            __block NSTimeInterval _timerInterval = MAX(_dwellInterval / 10, 10);
-            
-            dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+            _timerInterval = MAX(_dwellInterval / 10, 10);
             
             _dwellExit = 0;
             
-            _dwellTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
-            
-            dispatch_source_set_timer(_dwellTimer, dispatch_time(DISPATCH_TIME_NOW, _timerInterval * NSEC_PER_SEC), _timerInterval * NSEC_PER_SEC, (1ull * NSEC_PER_SEC) / 10);
+            _dwellScheduled = YES;
             
-            dispatch_source_set_event_handler(_dwellTimer, ^{
-                @synchronized(self) {
-                    if (_inside) {
-                        if (_exit) {
-                            _inside = NO;
-                        }
-                        else {
-                            _dwell = YES;
-                            
-                            _dwellExit = 0;
-                            
-                            [[QwasiLocationManager currentManager] emit: @"dwell", self];
-                            
-                            // Back off the dwell timers
-                            if (self.dwellTime > _dwellInterval * _dwellTic) {
-                                
-                                _timerInterval = _dwellInterval * _dwellTic++;
-                                
-                                dispatch_source_set_timer(_dwellTimer, dispatch_time(DISPATCH_TIME_NOW, _timerInterval * NSEC_PER_SEC), _timerInterval * NSEC_PER_SEC, (1ull * NSEC_PER_SEC) / 10);
-                            }
-                        }
-                    }
-                    else {
-                        dispatch_source_cancel(_dwellTimer);
-                        
-                        _dwell = NO;
-                        
-                        _dwellTimer = nil;
-                        
-                        [[QwasiLocationManager currentManager] emit: @"exit", self];
-                    }
+            [scheduler scheduleLocation: self after: _timerInterval];
+        }
+    }
+}
+
+// Called by the manager's dwell scheduler, returns when to check again or 0 once the location is exited
+- (NSTimeInterval)dwellTimerFired {
+    
+    @synchronized(self) {
+        if (_inside) {
+            if (_exit) {
+                _inside = NO;
+            }
+            else {
+                _dwell = YES;
+                
+                _dwellExit = 0;
+                
+                [[QwasiLocationManager currentManager] emit: @"dwell", self];
+                
+                // Back off the dwell timers
+                if (self.dwellTime > _dwellInterval * _dwellTic) {
+                    
+                    _timerInterval = _dwellInterval * _dwellTic++;
                 }
-            });
+            }
+            
+            return _timerInterval;
+        }
+        else {
+            _dwell = NO;
+            
+            _dwellScheduled = NO;
+            
+            [[QwasiLocationManager currentManager] emit: @"exit", self];
             
-            dispatch_resume(_dwellTimer);
+            return 0;
+        }
+    }
+}
+
+- (void)restoreInsideSince:(NSDate*)dwellStart {
+    
+    @synchronized(self) {
+        if (!_inside) {
+            _inside = YES;
+            _exit = NO;
+            _dwellStart = dwellStart ? dwellStart.timeIntervalSinceReferenceDate : QwasiLocationNow();
+            _dwellExit = 0;
+            
+            [self dwell];
+        }
+    }
+}
+
+- (void)updateWithLocationData:(NSDictionary*)data {
+    NSDictionary* beacon = data[@"beacon"];
+    NSDictionary* properties = data[@"properties"];
+    
+    @synchronized(self) {
+        _data = data;
+        _name = data[@"name"];
+        
+        // a shorter interval takes effect from the next tic, the elapsed dwell time is kept
+        _dwellInterval = [[properties valueForKey: @"dwell_interval"] doubleValue];
+        _dwellInterval = MAX(_dwellInterval, 60.0f);
+        
+        if (_type == QwasiLocationTypeBeacon && beacon && ![beacon isKindOfClass: [NSNull class]]) {
+            _vendor = [beacon valueForKey: @"type"];
+            _beaconProximity = [[beacon valueForKey: @"proximity"] doubleValue];
         }
     }
 }
@@ -285,7 +361,7 @@
     @synchronized(self) {
         if (_inside) {
             
-            _dwellExit = [NSDate timeIntervalSinceReferenceDate] - _dwellStart;
+            _dwellExit = QwasiLocationNow() - _dwellStart;
             
             _exit = YES;
         }
@@ -297,7 +373,7 @@
         return _dwellExit;
     }
     else if (_dwellStart) {
-        return [NSDate timeIntervalSinceReferenceDate] - _dwellStart;
+        return QwasiLocationNow() - _dwellStart;
     }
     
     return 0;
@@ -0,0 +1,68 @@
+//
+//  QwasiLocationIndex.h
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+
+#import "QwasiLocation.h"
+
+/** Grid index over a downloaded set of locations, so the regions to monitor can be picked on device
+ as the user moves. Beacons have no position and are always included. */
+@interface QwasiLocationIndex : NSObject
+
+@property (nonatomic,readonly) CLLocation* center;
+
+/** Distance from center the index is complete for */
+@property (nonatomic,readonly) CLLocationDistance radius;
+
+@property (nonatomic,readonly) NSArray* locations;
+
+/** Server change token for the locations, sent back to fetch only what changed since */
+@property (nonatomic,readonly) id token;
+
+/** When the locations were last fetched or brought up to date, defaults to when the index was made */
+@property (nonatomic,readwrite) NSDate* updated;
+
+- (id)initWithLocations:(NSArray*)locations center:(CLLocation*)center radius:(CLLocationDistance)radius;
+
+- (id)initWithLocations:(NSArray*)locations center:(CLLocation*)center radius:(CLLocationDistance)radius token:(id)token;
+
+/** A copy covering the same area with changed locations replaced or added and removed ids dropped */
+- (instancetype)indexByApplyingLocations:(NSArray*)changed removedIds:(NSArray*)removed token:(id)token;
+
+/** Reloads an index saved with -writeToFile:, nil if there is none */
++ (instancetype)indexWithContentsOfFile:(NSString*)path;
+
+- (BOOL)writeToFile:(NSString*)path;
+
+/** YES if every location within margin of the given location is in the index */
+- (BOOL)coversLocation:(CLLocation*)location margin:(CLLocationDistance)margin;
+
+/** Beacons first, then geofences by distance from the given location */
+- (NSArray*)locationsNearest:(CLLocation*)location limit:(NSUInteger)limit;
+@end
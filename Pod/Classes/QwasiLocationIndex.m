@@ -0,0 +1,274 @@
+//
+//  QwasiLocationIndex.m
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "QwasiLocationIndex.h"
+
+// ~1.1km of latitude per cell
+#define LOCATION_INDEX_CELL 0.01
+#define LOCATION_INDEX_MAX_RING 64
+
+static inline int32_t QwasiGridCell(CLLocationDegrees degrees) {
+    return (int32_t)floor(degrees / LOCATION_INDEX_CELL);
+}
+
+static inline NSNumber* QwasiGridKey(int32_t lat, int32_t lng) {
+    return [NSNumber numberWithLongLong: ((int64_t)lat << 32) | (uint32_t)lng];
+}
+
+@implementation QwasiLocationIndex {
+    NSMutableDictionary* _cells;
+    NSMutableArray* _beacons;
+    
+    int32_t _minLat, _maxLat, _minLng, _maxLng;
+}
+
+- (id)initWithLocations:(NSArray*)locations center:(CLLocation*)center radius:(CLLocationDistance)radius {
+    return [self initWithLocations: locations center: center radius: radius token: nil];
+}
+
+- (id)initWithLocations:(NSArray*)locations center:(CLLocation*)center radius:(CLLocationDistance)radius token:(id)token {
+    if (self = [super init]) {
+        _center = center;
+        _radius = radius;
+        _token = [token isKindOfClass: [NSNull class]] ? nil : token;
+        _updated = [NSDate date];
+        _locations = [locations copy];
+        _cells = [[NSMutableDictionary alloc] init];
+        _beacons = [[NSMutableArray alloc] init];
+        
+        _minLat = _minLng = INT32_MAX;
+        _maxLat = _maxLng = INT32_MIN;
+        
+        for (QwasiLocation* location in locations) {
+            if (location.type == QwasiLocationTypeBeacon) {
+                [_beacons addObject: location];
+                continue;
+            }
+            
+            int32_t lat = QwasiGridCell(location.latitude);
+            int32_t lng = QwasiGridCell(location.longitude);
+            NSNumber* key = QwasiGridKey(lat, lng);
+            NSMutableArray* cell = _cells[key];
+            
+            if (!cell) {
+                cell = [[NSMutableArray alloc] init];
+                _cells[key] = cell;
+            }
+            
+            [cell addObject: location];
+            
+            _minLat = MIN(_minLat, lat);
+            _maxLat = MAX(_maxLat, lat);
+            _minLng = MIN(_minLng, lng);
+            _maxLng = MAX(_maxLng, lng);
+        }
+    }
+    return self;
+}
+
++ (instancetype)indexWithContentsOfFile:(NSString*)path {
+    NSData* json = [NSData dataWithContentsOfFile: path];
+    NSDictionary* saved = json ? [NSJSONSerialization JSONObjectWithData: json options: 0 error: nil] : nil;
+    
+    if (![saved isKindOfClass: [NSDictionary class]] || ![saved[@"locations"] isKindOfClass: [NSArray class]]) {
+        return nil;
+    }
+    
+    NSMutableArray* locations = [[NSMutableArray alloc] init];
+    
+    for (NSDictionary* data in saved[@"locations"]) {
+        if ([data isKindOfClass: [NSDictionary class]]) {
+            [locations addObject: [[QwasiLocation alloc] initWithLocationData: data]];
+        }
+    }
+    
+    CLLocation* center = [[CLLocation alloc] initWithLatitude: [saved[@"lat"] doubleValue] longitude: [saved[@"lng"] doubleValue]];
+    
+    QwasiLocationIndex* index = [[QwasiLocationIndex alloc] initWithLocations: locations center: center radius: [saved[@"radius"] doubleValue] token: saved[@"token"]];
+    
+    // saves from before the field was added are as old as the file
+    if (saved[@"updated"]) {
+        index->_updated = [NSDate dateWithTimeIntervalSince1970: [saved[@"updated"] doubleValue]];
+    }
+    else {
+        index->_updated = [[[NSFileManager defaultManager] attributesOfItemAtPath: path error: nil] fileModificationDate] ?: [NSDate distantPast];
+    }
+    
+    return index;
+}
+
+- (instancetype)indexByApplyingLocations:(NSArray*)changed removedIds:(NSArray*)removed token:(id)token {
+    NSMutableDictionary* merged = [[NSMutableDictionary alloc] initWithCapacity: _locations.count + changed.count];
+    NSMutableArray* order = [[NSMutableArray alloc] initWithCapacity: _locations.count + changed.count];
+    
+    for (QwasiLocation* location in _locations) {
+        if (!location.id) {
+            continue;
+        }
+        
+        if (!merged[location.id]) {
+            [order addObject: location.id];
+        }
+        
+        merged[location.id] = location;
+    }
+    
+    for (QwasiLocation* location in changed) {
+        if (!location.id) {
+            continue;
+        }
+        
+        if (!merged[location.id]) {
+            [order addObject: location.id];
+        }
+        
+        merged[location.id] = location;
+    }
+    
+    if (removed) {
+        [merged removeObjectsForKeys: removed];
+    }
+    
+    NSMutableArray* locations = [[NSMutableArray alloc] initWithCapacity: merged.count];
+    
+    for (NSString* _id in order) {
+        if (merged[_id]) {
+            [locations addObject: merged[_id]];
+        }
+    }
+    
+    return [[QwasiLocationIndex alloc] initWithLocations: locations center: _center radius: _radius token: token ?: _token];
+}
+
+- (BOOL)writeToFile:(NSString*)path {
+    NSMutableArray* locations = [[NSMutableArray alloc] initWithCapacity: _locations.count];
+    
+    for (QwasiLocation* location in _locations) {
+        if (location.data) {
+            [locations addObject: location.data];
+        }
+    }
+    
+    NSMutableDictionary* saved = [[NSMutableDictionary alloc] init];
+    
+    saved[@"lat"] = [NSNumber numberWithDouble: _center.coordinate.latitude];
+    saved[@"lng"] = [NSNumber numberWithDouble: _center.coordinate.longitude];
+    saved[@"radius"] = [NSNumber numberWithDouble: _radius];
+    saved[@"updated"] = [NSNumber numberWithDouble: _updated.timeIntervalSince1970];
+    saved[@"locations"] = locations;
+    
+    if (_token) {
+        saved[@"token"] = _token;
+    }
+    
+    NSError* error;
+    NSData* json = [NSJSONSerialization dataWithJSONObject: saved options: 0 error: &error];
+    
+    if (!json || ![json writeToFile: path options: NSDataWritingAtomic error: &error]) {
+        NSLog(@"Failed to save location index: %@", error);
+        
+        return NO;
+    }
+    
+    return YES;
+}
+
+- (BOOL)coversLocation:(CLLocation*)location margin:(CLLocationDistance)margin {
+    if (!_center || !location) {
+        return NO;
+    }
+    
+    return [location distanceFromLocation: _center] + margin <= _radius;
+}
+
+- (NSArray*)locationsNearest:(CLLocation*)location limit:(NSUInteger)limit {
+    
+    NSMutableArray* nearest = [[NSMutableArray alloc] initWithArray: [_beacons subarrayWithRange: NSMakeRange(0, MIN(limit, _beacons.count))]];
+    NSUInteger needed = limit - nearest.count;
+    
+    if (needed == 0 || _cells.count == 0) {
+        return nearest;
+    }
+    
+    int32_t lat = QwasiGridCell(location.coordinate.latitude);
+    int32_t lng = QwasiGridCell(location.coordinate.longitude);
+    
+    // rings further out than the index bounds can't hold anything
+    int32_t maxRing = MAX(MAX(abs(lat - _minLat), abs(lat - _maxLat)), MAX(abs(lng - _minLng), abs(lng - _maxLng)));
+    
+    // the narrow side of a cell, anything in ring r+1 is at least r of these away
+    CLLocationDistance cellMeters = LOCATION_INDEX_CELL * 111320.0 * MAX(cos(location.coordinate.latitude * M_PI / 180.0), 0.01);
+    
+    NSMutableArray* candidates = [[NSMutableArray alloc] init];
+    
+    NSComparator byDistance = ^NSComparisonResult(NSArray* a, NSArray* b) {
+        return [a[0] compare: b[0]];
+    };
+    
+    // far from the indexed area the ring walk would visit mostly empty cells, just scan everything
+    if (maxRing > LOCATION_INDEX_MAX_RING) {
+        for (NSArray* cell in _cells.allValues) {
+            for (QwasiLocation* candidate in cell) {
+                [candidates addObject: @[ [NSNumber numberWithDouble: [location distanceFromLocation: candidate]], candidate ]];
+            }
+        }
+        
+        maxRing = -1;
+    }
+    
+    for (int32_t ring = 0; ring <= maxRing; ring++) {
+        
+        for (int32_t dy = -ring; dy <= ring; dy++) {
+            // only the perimeter of the ring, the inside was visited already
+            int32_t step = (dy == -ring || dy == ring) ? 1 : MAX(2 * ring, 1);
+            
+            for (int32_t dx = -ring; dx <= ring; dx += step) {
+                for (QwasiLocation* candidate in _cells[QwasiGridKey(lat + dy, lng + dx)]) {
+                    [candidates addObject: @[ [NSNumber numberWithDouble: [location distanceFromLocation: candidate]], candidate ]];
+                }
+            }
+        }
+        
+        if (candidates.count >= needed) {
+            [candidates sortUsingComparator: byDistance];
+            
+            if ([candidates[needed - 1][0] doubleValue] <= ring * cellMeters) {
+                break;
+            }
+        }
+    }
+    
+    [candidates sortUsingComparator: byDistance];
+    
+    for (NSUInteger i = 0; i < MIN(needed, candidates.count); i++) {
+        [nearest addObject: candidates[i][1]];
+    }
+    
+    return nearest;
+}
+@end
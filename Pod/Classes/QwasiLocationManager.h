@@ -31,25 +31,65 @@
 #import "EventEmitter.h"
 
 #import "QwasiError.h"
+#import "QwasiClock.h"
 #import "QwasiLocation.h"
+#import "QwasiDwellScheduler.h"
+#import "QwasiBeaconRanger.h"
 
 @interface QwasiLocationManager : EventEmitter<CLLocationManagerDelegate>
 
 @property (nonatomic,readonly) CLLocationManager* manager;
 @property (nonatomic,readwrite) CLLocationDistance updateDistance;
 @property (nonatomic,readwrite) NSTimeInterval updateInterval;
-@property (nonatomic,readonly) QwasiLocation* lastLocation;
+
+/** Lowers GPS accuracy while no geofence is close, raising it as one is approached. Defaults to YES. */
+@property (nonatomic,readwrite) BOOL adaptiveAccuracy;
+
+/** Most recent fix, raw fixes are plain CLLocations and QwasiLocation is kept for monitored places */
+@property (nonatomic,readonly) CLLocation* lastLocation;
 @property (nonatomic,readonly) NSArray* locations;
 
+/** Times dwell checks and beacon ranging pauses */
+@property (nonatomic,readonly) QwasiClock* clock;
+
+/** Where this manager keeps its monitored locations between launches */
+@property (nonatomic,readonly) NSString* statePath;
+
+/** Drives dwell and exit checks for every monitored location */
+@property (nonatomic,readonly) QwasiDwellScheduler* dwellScheduler;
+
+/** Smooths ranging readings into beacon enter and exit decisions */
+@property (nonatomic,readonly) QwasiBeaconRanger* beaconRanger;
+
 + (instancetype)currentManager;
 + (instancetype)foregroundManager;
 + (instancetype)backgroundManager;
 
+/** Makes manager the one locations report their events to, in place of the shared managers */
++ (void)setCurrentManager:(QwasiLocationManager*)manager;
+
+- (id)initWithRequiredAuthorization:(CLAuthorizationStatus)status;
+
+/** manager stands in for CoreLocation, its class answers authorizationStatus, e.g. to replay recorded traces */
+- (id)initWithLocationManager:(CLLocationManager*)manager requiredAuthorization:(CLAuthorizationStatus)status;
+
+/** As above, with the clock for its timers and the file for its saved state */
+- (id)initWithLocationManager:(CLLocationManager*)manager
+        requiredAuthorization:(CLAuthorizationStatus)status
+                        clock:(QwasiClock*)clock
+                    statePath:(NSString*)statePath;
+
 - (void)startLocationUpdates;
 - (void)stopLocationUpdates;
 
 - (void)startMonitoringLocation:(QwasiLocation*)location;
 - (void)stopMonitoringLocation:(QwasiLocation*)location;
+
+/** Refreshes a monitored location from a newer server record without restarting its region */
+- (void)updateMonitoredLocation:(QwasiLocation*)location withData:(NSDictionary*)data;
 - (void)startMonitoringLocations;
 - (void)stopMonitoringLocations;
+
+/** Where the monitored locations and their inside state are kept between launches, by default */
++ (NSString*)statePath;
 @end
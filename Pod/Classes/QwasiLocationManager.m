@@ -27,6 +27,25 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #import "QwasiLocationManager.h"
+#import "QwasiProximity.h"
+#import <UIKit/UIKit.h>
+
+#define LOCATION_STATE_SAVE_DELAY 1
+
+// Geofence edge within this many meters, or this many seconds at current speed, counts as near
+#define ACCURACY_NEAR_DISTANCE 200
+#define ACCURACY_NEAR_TIME 60
+#define ACCURACY_APPROACH_DISTANCE 1000
+#define ACCURACY_APPROACH_TIME 300
+
+// fraction past a boundary needed before dropping back to a coarser tier
+#define ACCURACY_HYSTERESIS 1.2
+
+typedef NS_ENUM(NSInteger, QwasiAccuracyTier) {
+    QwasiAccuracyTierNear = 0,
+    QwasiAccuracyTierApproach,
+    QwasiAccuracyTierFar
+};
 
 QwasiLocationManager* _activeManager = nil;
 
@@ -37,12 +56,36 @@ QwasiLocationManager* _activeManager = nil;
     BOOL _started;
     
     NSMutableDictionary* _regionMap;
+    QwasiProximity* _proximity;
+    
+    // beacon regions we are inside of, and those whose ranging is paused
+    NSMutableSet* _ranging;
+    NSMutableSet* _resting;
+    
+    BOOL _saveScheduled;
+    
+    QwasiAccuracyTier _tier;
+    BOOL _tierBackground;
+    BOOL _deferralRefused;
+}
+
++ (NSString*)statePath {
+    NSURL* support = [[[NSFileManager defaultManager] URLsForDirectory: NSApplicationSupportDirectory inDomains: NSUserDomainMask] lastObject];
+    NSURL* dir = [support URLByAppendingPathComponent: @"Qwasi" isDirectory: YES];
+    
+    [[NSFileManager defaultManager] createDirectoryAtURL: dir withIntermediateDirectories: YES attributes: nil error: nil];
+    
+    return [dir URLByAppendingPathComponent: @"locations.json"].path;
 }
 
 + (instancetype)currentManager {
     return _activeManager;
 }
 
++ (void)setCurrentManager:(QwasiLocationManager*)manager {
+    _activeManager = manager;
+}
+
 + (instancetype)foregroundManager {
     static dispatch_once_t once;
     static id sharedInstance = nil;
@@ -80,15 +123,30 @@ QwasiLocationManager* _activeManager = nil;
 }
 
 - (id)initWithLocationManager:(CLLocationManager*)manager requiredAuthorization:(CLAuthorizationStatus)status {
+    return [self initWithLocationManager: manager requiredAuthorization: status clock: [QwasiClock systemClock] statePath: [QwasiLocationManager statePath]];
+}
+
+- (id)initWithLocationManager:(CLLocationManager*)manager
+        requiredAuthorization:(CLAuthorizationStatus)status
+                        clock:(QwasiClock*)clock
+                    statePath:(NSString*)statePath {
     if (self = [super init]) {
         
+        _clock = clock;
+        _statePath = statePath;
         _requiredStatus = status;
-        _authStatus = [CLLocationManager authorizationStatus];
+        _authStatus = [[manager class] authorizationStatus];
         
         _updateDistance = 100;  // 100 meters
         _updateInterval = 900;  // 30 minutes
+        _adaptiveAccuracy = YES;
+        _tier = QwasiAccuracyTierNear;
         
         _regionMap = [[NSMutableDictionary alloc] init];
+        _dwellScheduler = [[QwasiDwellScheduler alloc] initWithClock: clock];
+        _beaconRanger = [[QwasiBeaconRanger alloc] init];
+        _ranging = [[NSMutableSet alloc] init];
+        _resting = [[NSMutableSet alloc] init];
         _manager = manager;
         _manager.delegate = self;
         _manager.desiredAccuracy = kCLLocationAccuracyBest;
@@ -99,17 +157,118 @@ QwasiLocationManager* _activeManager = nil;
         _manager.pausesLocationUpdatesAutomatically = NO;
 #endif
         
-        // Clear any existing regions
-        for (CLRegion* region in _manager.monitoredRegions) {
+        // Adopt the regions saved by the last launch that CoreLocation is still monitoring, clear the rest
+        [self restoreState];
+    }
+    return self;
+}
+
+#pragma mark - State
+- (void)restoreState {
+    NSData* json = [NSData dataWithContentsOfFile: _statePath];
+    NSArray* saved = json ? [NSJSONSerialization JSONObjectWithData: json options: 0 error: nil] : nil;
+    NSMutableDictionary* restored = [[NSMutableDictionary alloc] init];
+    
+    if (![saved isKindOfClass: [NSArray class]]) {
+        saved = nil;
+    }
+    
+    for (NSDictionary* entry in saved) {
+        if ([entry isKindOfClass: [NSDictionary class]] && [entry[@"data"] isKindOfClass: [NSDictionary class]]) {
+            QwasiLocation* location = [[QwasiLocation alloc] initWithLocationData: entry[@"data"]];
+            
+            if (location.id) {
+                if ([entry[@"inside"] boolValue]) {
+                    NSDate* dwellStart = [NSDate dateWithTimeIntervalSince1970: [entry[@"dwellStart"] doubleValue]];
+                    
+                    // dwell checks go through currentManager, which isn't set until init returns
+                    dispatch_async(dispatch_get_main_queue(), ^{
+                        [location restoreInsideSince: dwellStart];
+                    });
+                }
+                
+                restored[location.id] = location;
+            }
+        }
+    }
+    
+    for (CLRegion* region in _manager.monitoredRegions) {
+        QwasiLocation* location = restored[region.identifier];
+        
+        if (location) {
+            _regionMap[location.id] = location;
+            
+            // state may have changed while we weren't running
+            [_manager requestStateForRegion: region];
+        }
+        else {
             [_manager stopMonitoringForRegion: region];
         }
     }
-    return self;
+    
+    // saved regions CoreLocation dropped are monitored again
+    for (NSString* _id in restored) {
+        if (!_regionMap[_id]) {
+            QwasiLocation* location = restored[_id];
+            
+            _regionMap[_id] = location;
+            
+            [_manager startMonitoringForRegion: location.region];
+        }
+    }
+    
+    if (_regionMap.count > 0) {
+        NSLog(@"Restored %lu monitored locations.", (unsigned long)_regionMap.count);
+    }
+}
+
+- (void)setNeedsSave {
+    @synchronized(self) {
+        if (_saveScheduled) {
+            return;
+        }
+        
+        _saveScheduled = YES;
+    }
+    
+    // coalesce bursts of region changes into one write
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(LOCATION_STATE_SAVE_DELAY * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        NSMutableArray* state = [[NSMutableArray alloc] init];
+        
+        @synchronized(self) {
+            _saveScheduled = NO;
+            
+            for (QwasiLocation* location in _regionMap.allValues) {
+                NSMutableDictionary* entry = [[NSMutableDictionary alloc] init];
+                BOOL inside = (location.state == QwasiLocationStateInside || location.state == QwasiLocationStateDwell);
+                
+                if (!location.data) {
+                    continue;
+                }
+                
+                entry[@"data"] = location.data;
+                entry[@"inside"] = [NSNumber numberWithBool: inside];
+                
+                if (inside) {
+                    entry[@"dwellStart"] = [NSNumber numberWithDouble: [_clock.date timeIntervalSince1970] - location.dwellTime];
+                }
+                
+                [state addObject: entry];
+            }
+        }
+        
+        NSError* error;
+        NSData* json = [NSJSONSerialization dataWithJSONObject: state options: 0 error: &error];
+        
+        if (!json || ![json writeToFile: _statePath options: NSDataWritingAtomic error: &error]) {
+            NSLog(@"Failed to save location state: %@", error);
+        }
+    });
 }
 
 - (void)startLocationUpdates {
     
-     _authStatus = [CLLocationManager authorizationStatus];
+     _authStatus = [[_manager class] authorizationStatus];
     
     switch (_authStatus) {
         case kCLAuthorizationStatusNotDetermined:
@@ -166,21 +325,40 @@ QwasiLocationManager* _activeManager = nil;
             }
             else {
                 _regionMap[location.id] = location;
+                _proximity = nil;
                 
                 [_manager startMonitoringForRegion: location.region];
                 [_manager disallowDeferredLocationUpdates];
+                
+                [self setNeedsSave];
             }
         }
     }
 }
 
+- (void)updateMonitoredLocation:(QwasiLocation*)location withData:(NSDictionary*)data {
+    
+    [location updateWithLocationData: data];
+    
+    @synchronized(self) {
+        if (_regionMap[location.id] == location) {
+            // the ranger reads beacon proximity from the location on every pass
+            [self setNeedsSave];
+        }
+    }
+}
+
 - (void)stopMonitoringLocation:(QwasiLocation*)location {
     
     @synchronized(self) {
         if ([_regionMap objectForKey: location.id]) {
             [_manager stopMonitoringForRegion: location.region];
             [_regionMap removeObjectForKey: location.id];
+            _proximity = nil;
+            [self stopRangingLocation: location];
             [location exit];
+            
+            [self setNeedsSave];
         }
     }
 }
@@ -199,6 +377,7 @@ QwasiLocationManager* _activeManager = nil;
     @synchronized(self) {
         tmp = _regionMap;
         _regionMap = [[NSMutableDictionary alloc] init];
+        _proximity = nil;
     }
     
     for (NSString* _id in tmp) {
@@ -206,24 +385,185 @@ QwasiLocationManager* _activeManager = nil;
         
         [_manager stopMonitoringForRegion: location.region];
         
+        [self stopRangingLocation: location];
+        
         [location exit];
     }
     
     [tmp removeAllObjects];
+    
+    [self setNeedsSave];
 }
 
 - (NSArray*)locations {
     return [_regionMap allValues];
 }
 
+#pragma mark - Beacon ranging
+- (void)startRangingLocation:(QwasiLocation*)location {
+    @synchronized(self) {
+        [_ranging addObject: location.id];
+        [_resting removeObject: location.id];
+    }
+    
+    [_manager startRangingBeaconsInRegion: (CLBeaconRegion*)location.region];
+}
+
+- (void)stopRangingLocation:(QwasiLocation*)location {
+    if (location.type != QwasiLocationTypeBeacon) {
+        return;
+    }
+    
+    @synchronized(self) {
+        [_ranging removeObject: location.id];
+        [_resting removeObject: location.id];
+    }
+    
+    [_manager stopRangingBeaconsInRegion: (CLBeaconRegion*)location.region];
+    [_beaconRanger removeLocation: location];
+}
+
+// Ranging keeps the radio on, while the decision is settled region monitoring is enough to catch an exit
+- (void)restRangingLocation:(QwasiLocation*)location {
+    @synchronized(self) {
+        if ([_resting containsObject: location.id]) {
+            return;
+        }
+        
+        [_resting addObject: location.id];
+    }
+    
+    [_manager stopRangingBeaconsInRegion: (CLBeaconRegion*)location.region];
+    
+    [_clock scheduleAfter: _beaconRanger.restInterval leeway: 1 queue: dispatch_get_main_queue() block: ^{
+        BOOL resume;
+        
+        @synchronized(self) {
+            resume = [_resting containsObject: location.id] && [_ranging containsObject: location.id] && _regionMap[location.id] == location;
+            
+            [_resting removeObject: location.id];
+        }
+        
+        if (resume) {
+            [_beaconRanger resumeLocation: location];
+            
+            [_manager startRangingBeaconsInRegion: (CLBeaconRegion*)location.region];
+        }
+    }];
+}
+
+#pragma mark - Adaptive accuracy
+- (CLLocationDistance)distanceToNearestGeofence:(CLLocation*)location {
+    CLLocationDistance nearest = CLLocationDistanceMax;
+    QwasiProximity* proximity;
+    
+    @synchronized(self) {
+        // rebuilt only when the monitored set changes, every fix reuses it
+        if (!_proximity) {
+            NSMutableArray* geofences = [[NSMutableArray alloc] init];
+            
+            for (QwasiLocation* region in _regionMap.allValues) {
+                if (region.type == QwasiLocationTypeGeofence) {
+                    [geofences addObject: region];
+                }
+            }
+            
+            _proximity = [[QwasiProximity alloc] initWithLocations: geofences];
+        }
+        
+        proximity = _proximity;
+    }
+    
+    [proximity nearestEdgeTo: location distance: &nearest];
+    
+    return nearest;
+}
+
+- (void)adaptAccuracyForLocation:(CLLocation*)location {
+    
+    if (!_adaptiveAccuracy) {
+        return;
+    }
+    
+    CLLocationDistance edge = [self distanceToNearestGeofence: location];
+    CLLocationSpeed speed = MAX(location.speed, 0);
+    CLLocationDistance near = MAX(ACCURACY_NEAR_DISTANCE, speed * ACCURACY_NEAR_TIME);
+    CLLocationDistance approach = MAX(ACCURACY_APPROACH_DISTANCE, speed * ACCURACY_APPROACH_TIME);
+    BOOL background = [UIApplication sharedApplication].applicationState == UIApplicationStateBackground;
+    
+    QwasiAccuracyTier tier;
+    
+    if (edge <= near) {
+        tier = QwasiAccuracyTierNear;
+    }
+    else if (edge <= approach) {
+        tier = QwasiAccuracyTierApproach;
+    }
+    else {
+        tier = QwasiAccuracyTierFar;
+    }
+    
+    // Raise accuracy straight away, but only relax it once clearly past the boundary
+    if (tier > _tier) {
+        if ((_tier == QwasiAccuracyTierNear && edge <= near * ACCURACY_HYSTERESIS) ||
+            (_tier == QwasiAccuracyTierApproach && edge <= approach * ACCURACY_HYSTERESIS)) {
+            tier = _tier;
+        }
+    }
+    
+    if (tier == _tier && background == _tierBackground) {
+        return;
+    }
+    
+    _tier = tier;
+    _tierBackground = background;
+    
+    switch (tier) {
+        case QwasiAccuracyTierNear:
+            _manager.desiredAccuracy = kCLLocationAccuracyBest;
+            _manager.distanceFilter = kCLDistanceFilterNone;
+            break;
+            
+        case QwasiAccuracyTierApproach:
+            _manager.desiredAccuracy = kCLLocationAccuracyNearestTenMeters;
+            _manager.distanceFilter = 25;
+            break;
+            
+        case QwasiAccuracyTierFar:
+            // region monitoring still catches an enter, the GPS only has to follow the user roughly
+            _manager.desiredAccuracy = background ? kCLLocationAccuracyKilometer : kCLLocationAccuracyHundredMeters;
+            _manager.distanceFilter = 50;
+            break;
+    }
+    
+    // settings changed, a deferral refused under the old ones may work now
+    _deferralRefused = NO;
+    
+    if (_deferred && ![self canDeferUpdates]) {
+        [_manager disallowDeferredLocationUpdates];
+        
+        _deferred = NO;
+    }
+}
+
+// iOS only defers with the GPS at best accuracy and no distance filter, the coarser tiers save power by other means
+- (BOOL)canDeferUpdates {
+    return !_deferralRefused &&
+        _manager.desiredAccuracy == kCLLocationAccuracyBest &&
+        _manager.distanceFilter == kCLDistanceFilterNone &&
+        [[_manager class] deferredLocationUpdatesAvailable];
+}
+
 #pragma mark - CLLocationManagerDelegate
 - (void)locationManager:(CLLocationManager *)manager didUpdateLocations:(NSArray *)locations {
     
-    _lastLocation = [[QwasiLocation alloc] initWithLocation: [locations lastObject]];
+    _lastLocation = [locations lastObject];
+    
+    [self adaptAccuracyForLocation: _lastLocation];
     
     [self emit: @"location", _lastLocation];
     
-    if (!_deferred && (_authStatus == kCLAuthorizationStatusAuthorizedAlways) ) {
+    if (!_deferred && (_authStatus == kCLAuthorizationStatusAuthorizedAlways) && [self canDeferUpdates]) {
         
         [_manager allowDeferredLocationUpdatesUntilTraveled: _updateDistance timeout: _updateInterval];
         
@@ -245,6 +585,13 @@ QwasiLocationManager* _activeManager = nil;
 
 - (void)locationManager:(CLLocationManager *)manager didFinishDeferredUpdatesWithError:(NSError *)error {
     _deferred = NO;
+    
+    // anything but a cancel will fail the same way again, don't ask on every fix until settings change
+    if (error && [error.domain isEqualToString: kCLErrorDomain] && error.code != kCLErrorDeferredCanceled) {
+        NSLog(@"Deferred location updates unavailable, %@", error);
+        
+        _deferralRefused = YES;
+    }
 }
 
 - (void)locationManager:(CLLocationManager *)manager didStartMonitoringForRegion:(CLRegion *)region {
@@ -299,11 +646,13 @@ QwasiLocationManager* _activeManager = nil;
     if (location) {
         
         if (location.type == QwasiLocationTypeBeacon) {
-            [_manager startRangingBeaconsInRegion: (CLBeaconRegion*)region];
+            [self startRangingLocation: location];
         }
         else {
             [location enter];
         }
+        
+        [self setNeedsSave];
     }
 }
 
@@ -311,7 +660,11 @@ QwasiLocationManager* _activeManager = nil;
     QwasiLocation* location = [_regionMap objectForKey: region.identifier];
     
     if (location) {
+        [self stopRangingLocation: location];
+        
         [location exit];
+        
+        [self setNeedsSave];
     }
 }
 
@@ -322,7 +675,7 @@ QwasiLocationManager* _activeManager = nil;
         switch (state) {
             case CLRegionStateInside:
                 if (location.type == QwasiLocationTypeBeacon) {
-                    [_manager startRangingBeaconsInRegion: (CLBeaconRegion*)region];
+                    [self startRangingLocation: location];
                 }
                 else {
                     [location enter];
@@ -330,29 +683,48 @@ QwasiLocationManager* _activeManager = nil;
                 break;
                 
             case CLRegionStateOutside:
+                [self stopRangingLocation: location];
+                
                 [location exit];
                 break;
                 
             default:
                 break;
         }
+        
+        [self setNeedsSave];
     }
 }
 
 - (void)locationManager:(CLLocationManager *)manager didRangeBeacons:(NSArray *)beacons inRegion:(CLBeaconRegion *)region {
     QwasiLocation* location = [_regionMap objectForKey: region.identifier];
-    CLBeacon* beacon = beacons.count > 0 ? beacons[0] : nil;
+    CLBeacon* beacon = nil;
     
-    if (location && beacon) {
-        
-        if ((beacon.accuracy > 0) &&
-            (beacon.accuracy <= location.beaconProximity)) {
-            
-            [location enterWithBeacon: beacon];
+    if (!location) {
+        return;
+    }
+    
+    for (CLBeacon* candidate in beacons) {
+        if (!beacon || (candidate.accuracy > 0 && (beacon.accuracy <= 0 || candidate.accuracy < beacon.accuracy))) {
+            beacon = candidate;
         }
-        else {
+    }
+    
+    switch ([_beaconRanger updateLocation: location withBeacons: beacons]) {
+        case QwasiBeaconDecisionEnter:
+            [location enterWithBeacon: beacon];
+            break;
+            
+        case QwasiBeaconDecisionExit:
             [location exitWithBeacon: beacon];
-        }
+            break;
+            
+        default:
+            break;
+    }
+    
+    if ([_beaconRanger isStableLocation: location]) {
+        [self restRangingLocation: location];
     }
 }
 
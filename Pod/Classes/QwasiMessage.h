@@ -27,6 +27,7 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #import <Foundation/Foundation.h>
+#import <UIKit/UIKit.h>
 
 @interface QwasiMessage : NSObject<NSCoding>
 
@@ -36,8 +37,12 @@
 @property (nonatomic,readonly) NSString* application;
 @property (nonatomic,readonly) NSString* payloadType;
 @property (nonatomic,readonly) NSString* payloadSHA;
+/** Content encoding of rawPayload, "gzip" or "deflate", or nil when it is stored as is */
+@property (nonatomic,readonly) NSString* payloadEncoding;
 @property (nonatomic,readonly) id payload;
 @property (nonatomic,readonly) NSData* rawPayload;
+/** Base64 form of rawPayload, built on demand */
+@property (nonatomic,readonly) NSString* encodedPayload;
 @property (nonatomic,readonly) NSArray* tags;
 @property (nonatomic,readonly) BOOL silent;
 @property (nonatomic,readonly) BOOL selected;
@@ -46,10 +51,31 @@
 @property (nonatomic,readonly) BOOL valid;
 @property (nonatomic,readonly) BOOL cached;
 
+/** Longest side, in pixels, image payloads are downsampled to when decoded. 0 decodes at full size. */
+@property (nonatomic,readwrite) CGFloat imageMaxPixelSize;
+
 + (instancetype)messageWithData:(NSDictionary*)data;
 
+/** Restores a message from -archive, or from an NSKeyedArchiver archive */
 + (instancetype)messageWithArchive:(NSData*)archive updateFlags:(BOOL)update;
 
+/** Encoded size in bytes above which multipart payloads are decoded in parallel */
++ (NSUInteger)parallelDecodeThreshold;
++ (void)setParallelDecodeThreshold:(NSUInteger)threshold;
+
+/** gzip compresses a payload for sending with payload_encoding "gzip" */
++ (NSData*)compressPayloadData:(NSData*)data;
+
+/** Inflates gzip or zlib data a chunk at a time, returns nil if the stream is corrupt or inflates past 64MB */
++ (NSData*)inflatePayloadData:(NSData*)data;
++ (NSData*)inflatePayloadData:(NSData*)data maxLength:(NSUInteger)maxLength;
+
+/** Decodes the payload on a background queue and calls completion on the main queue */
+- (void)payloadWithCompletion:(void(^)(id payload))completion;
+
+/** Compact versioned binary archive of the message, with the payload bytes stored directly */
+- (NSData*)archive;
+
 - (id)initWithAlert:(NSString*)alert
         withPayload:(id)payload
     withPayloadType:(NSString*)payloadType
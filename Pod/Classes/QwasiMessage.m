@@ -27,7 +27,9 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #import "QwasiMessage.h"
+#import "QwasiImageDecoder.h"
 #import <CommonCrypto/CommonDigest.h>
+#import <zlib.h>
 
 #ifdef __IPHONE_8_0
 #define GregorianCalendar NSCalendarIdentifierGregorian
@@ -35,6 +37,126 @@
 #define GregorianCalendar NSGregorianCalendar
 #endif
 
+#define BASE64_CHUNK_SIZE 4096
+#define AIM_PARALLEL_THRESHOLD 64 * 1024
+#define INFLATE_CHUNK_SIZE 16 * 1024
+#define INFLATE_MAX_PRESIZE 16 * 1024 * 1024
+#define INFLATE_MAX_LENGTH 64 * 1024 * 1024
+
+static NSUInteger _parallelDecodeThreshold = AIM_PARALLEL_THRESHOLD;
+
+static inline int QwasiBase64Value(unsigned char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+static inline int QwasiHexValue(unichar c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static BOOL QwasiParseSHA1(NSString* sha, unsigned char digest[CC_SHA1_DIGEST_LENGTH]) {
+    
+    if (![sha isKindOfClass: [NSString class]] || sha.length != CC_SHA1_DIGEST_LENGTH * 2) {
+        return NO;
+    }
+    
+    for (NSUInteger i = 0; i < CC_SHA1_DIGEST_LENGTH; i++) {
+        int hi = QwasiHexValue([sha characterAtIndex: i * 2]);
+        int lo = QwasiHexValue([sha characterAtIndex: i * 2 + 1]);
+        
+        if (hi < 0 || lo < 0) {
+            return NO;
+        }
+        
+        digest[i] = (unsigned char)((hi << 4) | lo);
+    }
+    
+    return YES;
+}
+
+// Binary archive layout: "QWM" magic, a version byte, then tag | varint length | bytes fields.
+// Readers skip tags they don't know, so new fields don't need a version bump.
+#define MESSAGE_ARCHIVE_VERSION 1
+
+typedef NS_ENUM(uint8_t, QwasiMessageField) {
+    QwasiMessageFieldId = 1,
+    QwasiMessageFieldApplication,
+    QwasiMessageFieldText,
+    QwasiMessageFieldTimestamp,
+    QwasiMessageFieldPayloadType,
+    QwasiMessageFieldPayloadSHA,
+    QwasiMessageFieldTag,
+    QwasiMessageFieldFlags,
+    QwasiMessageFieldRawPayload,
+    QwasiMessageFieldEncodedPayload,
+    QwasiMessageFieldPayloadEncoding
+};
+
+typedef NS_OPTIONS(uint8_t, QwasiMessageFlags) {
+    QwasiMessageFlagFetched = 1 << 0,
+    QwasiMessageFlagSelected = 1 << 1,
+    QwasiMessageFlagBackground = 1 << 2
+};
+
+static const uint8_t kMessageArchiveMagic[3] = { 'Q', 'W', 'M' };
+
+static void QwasiWriteVarint(NSMutableData* out, uint64_t value) {
+    uint8_t buf[10];
+    size_t count = 0;
+    
+    do {
+        uint8_t byte = value & 0x7f;
+        
+        value >>= 7;
+        
+        buf[count++] = value ? (byte | 0x80) : byte;
+    } while (value);
+    
+    [out appendBytes: buf length: count];
+}
+
+static void QwasiWriteField(NSMutableData* out, QwasiMessageField tag, const void* bytes, NSUInteger length) {
+    [out appendBytes: &tag length: 1];
+    
+    QwasiWriteVarint(out, length);
+    
+    if (length) {
+        [out appendBytes: bytes length: length];
+    }
+}
+
+static void QwasiWriteString(NSMutableData* out, QwasiMessageField tag, NSString* value) {
+    if ([value isKindOfClass: [NSString class]]) {
+        const char* utf8 = value.UTF8String;
+        
+        QwasiWriteField(out, tag, utf8, strlen(utf8));
+    }
+}
+
+static BOOL QwasiReadVarint(const uint8_t** cursor, const uint8_t* end, uint64_t* value) {
+    uint64_t result = 0;
+    
+    for (int shift = 0; *cursor < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*cursor)++;
+        
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        
+        if (!(byte & 0x80)) {
+            *value = result;
+            return YES;
+        }
+    }
+    
+    return NO;
+}
+
 @interface QwasiMessage (Private)
 @property (nonatomic,readwrite) BOOL selected;
 @property (nonatomic,readwrite) BOOL background;
@@ -42,6 +164,17 @@
 
 @implementation QwasiMessage {
     NSString* _encodedPayload;
+    id _payload;
+    NSData* _rawPayload;
+    BOOL _rawPayloadDecoded;
+    BOOL _payloadDecoded;
+    
+    // the shared image cache owns decoded bitmaps, this finds one again while anything still holds it
+    __weak UIImage* _payloadImage;
+    
+    // payload_sha parsed once into raw digest bytes
+    unsigned char _payloadDigest[CC_SHA1_DIGEST_LENGTH];
+    BOOL _hasPayloadDigest;
 }
 
 + (instancetype)messageWithData:(NSDictionary*)data {
@@ -49,7 +182,15 @@
 }
 
 + (instancetype)messageWithArchive:(NSData*)archive updateFlags:(BOOL)update {
-    QwasiMessage* msg = [NSKeyedUnarchiver unarchiveObjectWithData: archive];
+    QwasiMessage* msg;
+    
+    if (archive.length >= sizeof(kMessageArchiveMagic) && memcmp(archive.bytes, kMessageArchiveMagic, sizeof(kMessageArchiveMagic)) == 0) {
+        msg = [[QwasiMessage alloc] initWithArchive: archive];
+    }
+    else if (archive) {
+        // archives written before the binary format
+        msg = [NSKeyedUnarchiver unarchiveObjectWithData: archive];
+    }
     
     if (update) {
         [msg updateStateFlags];
@@ -58,6 +199,171 @@
     return msg;
 }
 
+- (id)initWithArchive:(NSData*)archive {
+    if (self = [super init]) {
+        // payload slices point into the archive, so it must not change underneath them
+        archive = [archive copy];
+        
+        if (archive.length < sizeof(kMessageArchiveMagic) + 1 || memcmp(archive.bytes, kMessageArchiveMagic, sizeof(kMessageArchiveMagic)) != 0) {
+            NSLog(@"Invalid message archive header.");
+            return nil;
+        }
+        
+        // fields are only ever added, a higher version changed their meaning
+        uint8_t version = ((const uint8_t*)archive.bytes)[sizeof(kMessageArchiveMagic)];
+        
+        if (version != MESSAGE_ARCHIVE_VERSION) {
+            NSLog(@"Unsupported message archive version %d.", version);
+            return nil;
+        }
+        
+        const uint8_t* cursor = (const uint8_t*)archive.bytes + sizeof(kMessageArchiveMagic) + 1;
+        const uint8_t* end = (const uint8_t*)archive.bytes + archive.length;
+        NSMutableArray* tags = [[NSMutableArray alloc] init];
+        
+        _cached = YES;
+        
+        while (cursor < end) {
+            QwasiMessageField tag = *cursor++;
+            uint64_t length;
+            
+            if (!QwasiReadVarint(&cursor, end, &length) || length > (uint64_t)(end - cursor)) {
+                NSLog(@"Truncated message archive.");
+                return nil;
+            }
+            
+            switch (tag) {
+                case QwasiMessageFieldId:
+                    _messageId = [[NSString alloc] initWithBytes: cursor length: length encoding: NSUTF8StringEncoding];
+                    break;
+                    
+                case QwasiMessageFieldApplication:
+                    _application = [[NSString alloc] initWithBytes: cursor length: length encoding: NSUTF8StringEncoding];
+                    break;
+                    
+                case QwasiMessageFieldText:
+                    _alert = [[NSString alloc] initWithBytes: cursor length: length encoding: NSUTF8StringEncoding];
+                    break;
+                    
+                case QwasiMessageFieldTimestamp:
+                    if (length == sizeof(CFSwappedFloat64)) {
+                        CFSwappedFloat64 swapped;
+                        
+                        memcpy(&swapped, cursor, sizeof(swapped));
+                        
+                        _timestamp = CFConvertDoubleSwappedToHost(swapped);
+                    }
+                    break;
+                    
+                case QwasiMessageFieldPayloadType:
+                    _payloadType = [[NSString alloc] initWithBytes: cursor length: length encoding: NSUTF8StringEncoding];
+                    break;
+                    
+                case QwasiMessageFieldPayloadEncoding:
+                    _payloadEncoding = [[NSString alloc] initWithBytes: cursor length: length encoding: NSUTF8StringEncoding];
+                    break;
+                    
+                case QwasiMessageFieldPayloadSHA:
+                    if (length == CC_SHA1_DIGEST_LENGTH) {
+                        char hex[CC_SHA1_DIGEST_LENGTH * 2 + 1];
+                        
+                        memcpy(_payloadDigest, cursor, CC_SHA1_DIGEST_LENGTH);
+                        
+                        for (int i = 0; i < CC_SHA1_DIGEST_LENGTH; i++) {
+                            snprintf(hex + i * 2, 3, "%02x", _payloadDigest[i]);
+                        }
+                        
+                        _payloadSHA = [[NSString alloc] initWithBytes: hex length: CC_SHA1_DIGEST_LENGTH * 2 encoding: NSASCIIStringEncoding];
+                        _hasPayloadDigest = YES;
+                    }
+                    break;
+                    
+                case QwasiMessageFieldTag:
+                {
+                    NSString* value = [[NSString alloc] initWithBytes: cursor length: length encoding: NSUTF8StringEncoding];
+                    
+                    if (value) {
+                        [tags addObject: value];
+                    }
+                }
+                    break;
+                    
+                case QwasiMessageFieldFlags:
+                    if (length == 1) {
+                        _fetched = (*cursor & QwasiMessageFlagFetched) != 0;
+                        _selected = (*cursor & QwasiMessageFlagSelected) != 0;
+                        _background = (*cursor & QwasiMessageFlagBackground) != 0;
+                    }
+                    break;
+                    
+                case QwasiMessageFieldRawPayload:
+                    // already verified when it was archived, keep a slice of the archive rather than a copy
+                    _rawPayload = [[NSData alloc] initWithBytesNoCopy: (void*)cursor length: (NSUInteger)length deallocator: ^(void *bytes, NSUInteger len) {
+                        [archive length];
+                    }];
+                    _rawPayloadDecoded = YES;
+                    break;
+                    
+                case QwasiMessageFieldEncodedPayload:
+                    _encodedPayload = [[NSString alloc] initWithBytes: cursor length: length encoding: NSASCIIStringEncoding];
+                    break;
+                    
+                default:
+                    break;
+            }
+            
+            cursor += length;
+        }
+        
+        _tags = tags;
+    }
+    return self;
+}
+
+- (NSData*)archive {
+    NSMutableData* out = [[NSMutableData alloc] initWithCapacity: 256];
+    uint8_t version = MESSAGE_ARCHIVE_VERSION;
+    QwasiMessageFlags flags = (_fetched ? QwasiMessageFlagFetched : 0) |
+                              (_selected ? QwasiMessageFlagSelected : 0) |
+                              (_background ? QwasiMessageFlagBackground : 0);
+    CFSwappedFloat64 timestamp = CFConvertDoubleHostToSwapped(_timestamp);
+    
+    [out appendBytes: kMessageArchiveMagic length: sizeof(kMessageArchiveMagic)];
+    [out appendBytes: &version length: 1];
+    
+    QwasiWriteString(out, QwasiMessageFieldId, _messageId);
+    QwasiWriteString(out, QwasiMessageFieldApplication, _application);
+    QwasiWriteString(out, QwasiMessageFieldText, _alert);
+    QwasiWriteField(out, QwasiMessageFieldTimestamp, &timestamp, sizeof(timestamp));
+    QwasiWriteString(out, QwasiMessageFieldPayloadType, _payloadType);
+    QwasiWriteString(out, QwasiMessageFieldPayloadEncoding, _payloadEncoding);
+    QwasiWriteField(out, QwasiMessageFieldFlags, &flags, 1);
+    
+    if ([_tags isKindOfClass: [NSArray class]]) {
+        for (NSString* tag in _tags) {
+            QwasiWriteString(out, QwasiMessageFieldTag, tag);
+        }
+    }
+    
+    if (_hasPayloadDigest) {
+        QwasiWriteField(out, QwasiMessageFieldPayloadSHA, _payloadDigest, CC_SHA1_DIGEST_LENGTH);
+    }
+    
+    // A payload_sha that didn't parse can never verify, so there is no payload worth keeping
+    if (!_payloadSHA || _hasPayloadDigest) {
+        @synchronized(self) {
+            if (_rawPayload) {
+                QwasiWriteField(out, QwasiMessageFieldRawPayload, _rawPayload.bytes, _rawPayload.length);
+            }
+            else {
+                QwasiWriteString(out, QwasiMessageFieldEncodedPayload, _encodedPayload);
+            }
+        }
+    }
+    
+    return out;
+}
+
 - (id)initWithCoder:(NSCoder *)aDecoder {
     if (self = [super init]) {
         _cached = YES;
@@ -67,16 +373,15 @@
         _timestamp = [[aDecoder decodeObjectForKey: @"timestamp"] doubleValue];
         _payloadType = [aDecoder decodeObjectForKey: @"payload_type"];
         _payloadSHA =[aDecoder decodeObjectForKey: @"payload_sha"];
+        _payloadEncoding = [aDecoder decodeObjectForKey: @"payload_encoding"];
         _tags = [aDecoder decodeObjectForKey: @"tags"];
         _selected = [aDecoder decodeBoolForKey: @"selected"];
         _background = [aDecoder decodeBoolForKey: @"background"];
         _fetched = [aDecoder decodeBoolForKey: @"fetched"];
+        _hasPayloadDigest = QwasiParseSHA1(_payloadSHA, _payloadDigest);
         
+        // the payload is decoded on first access
         _encodedPayload = [aDecoder decodeObjectForKey: @"encodedPayload"];
-        
-        if (_encodedPayload) {
-            _payload = [QwasiMessage decodePayload: _encodedPayload withSHA: _payloadSHA withType: _payloadType];
-        }
     }
     return self;
 }
@@ -111,15 +416,17 @@
         
         _payloadType = [data objectForKey: @"payload_type"];
         _payloadSHA = [data objectForKey: @"payload_sha"];
+        _payloadEncoding = [data objectForKey: @"payload_encoding"];
+        
+        if (![_payloadEncoding isKindOfClass: [NSString class]]) {
+            _payloadEncoding = nil;
+        }
         _tags = [data valueForKeyPath: @"tags"];
         _fetched = [[data valueForKeyPath: @"flags.fetched"] boolValue];
+        _hasPayloadDigest = QwasiParseSHA1(_payloadSHA, _payloadDigest);
         
-        // decode the payload
+        // the payload is decoded on first access
         _encodedPayload = [data objectForKey: @"payload"];
-        
-        if (_encodedPayload) {
-            _payload = [QwasiMessage decodePayload: _encodedPayload withSHA: _payloadSHA withType: _payloadType];
-        }
     }
     
     return self;
@@ -133,6 +440,7 @@
     if (self = [super init]) {
         _alert = alert;
         _payload = payload;
+        _payloadDecoded = YES;
         _payloadType = payloadType;
         _tags = [[NSArray alloc] initWithArray: tags];
         _timestamp = [[NSDate dateWithTimeIntervalSince1970:0] timeIntervalSince1970];
@@ -165,13 +473,108 @@
     [aCoder encodeObject: [NSNumber numberWithDouble: _timestamp] forKey: @"timestamp"];
     [aCoder encodeObject: _payloadType forKey: @"payload_type"];
     [aCoder encodeObject: _payloadSHA forKey: @"payload_sha"];
+    [aCoder encodeObject: _payloadEncoding forKey: @"payload_encoding"];
     [aCoder encodeObject: _tags forKey: @"tags"];
-    [aCoder encodeObject: _encodedPayload forKey: @"encodedPayload"];
+    [aCoder encodeObject: self.encodedPayload forKey: @"encodedPayload"];
     [aCoder encodeBool: _fetched forKey: @"fetched"];
     [aCoder encodeBool: _selected forKey: @"selected"];
     [aCoder encodeBool: _background forKey: @"background"];
 }
 
+- (NSData*)rawPayload {
+    
+    @synchronized(self) {
+        if (!_rawPayloadDecoded) {
+            
+            // a payload_sha that can't be parsed can never match
+            if ([_encodedPayload isKindOfClass: [NSString class]] && (_hasPayloadDigest || !_payloadSHA)) {
+                _rawPayload = [QwasiMessage decodeBase64: _encodedPayload withDigest: _hasPayloadDigest ? _payloadDigest : NULL];
+            }
+            
+            // Only one copy of the payload is held, base64 is rebuilt on demand
+            _encodedPayload = nil;
+            _rawPayloadDecoded = YES;
+        }
+        
+        return _rawPayload;
+    }
+}
+
+- (NSString*)encodedPayload {
+    
+    @synchronized(self) {
+        if (_encodedPayload) {
+            return _encodedPayload;
+        }
+        
+        return [_rawPayload base64EncodedStringWithOptions: 0];
+    }
+}
+
+- (id)payload {
+    
+    @synchronized(self) {
+        UIImage* image = _payloadImage;
+        
+        if (image) {
+            return image;
+        }
+        
+        if (!_payloadDecoded) {
+            id payload = nil;
+            NSString* key = _payloadSHA;
+            
+            if (self.rawPayload) {
+                // without a digest the message id and size identify the bytes
+                if (!key && _messageId) {
+                    key = [NSString stringWithFormat: @"%@:%lu", _messageId, (unsigned long)_rawPayload.length];
+                }
+                
+                // rawPayload stays compressed, it is only inflated for decoding
+                payload = [QwasiMessage payloadWithData: _rawPayload
+                                               withType: _payloadType
+                                               encoding: _payloadEncoding
+                                                 forKey: key
+                                           maxPixelSize: _imageMaxPixelSize];
+            }
+            
+            // Decoded bitmaps live in the shared image cache rather than on the message,
+            // unkeyed images can't be found there again so they are kept here
+            if (key && [payload isKindOfClass: [UIImage class]]) {
+                _payloadImage = payload;
+                
+                return payload;
+            }
+            
+            _payload = payload;
+            _payloadDecoded = YES;
+        }
+        
+        return _payload;
+    }
+}
+
+- (void)setImageMaxPixelSize:(CGFloat)imageMaxPixelSize {
+    
+    @synchronized(self) {
+        if (imageMaxPixelSize != _imageMaxPixelSize) {
+            _imageMaxPixelSize = imageMaxPixelSize;
+            _payloadImage = nil;
+        }
+    }
+}
+
+- (void)payloadWithCompletion:(void(^)(id payload))completion {
+    
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        id payload = self.payload;
+        
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (completion) completion(payload);
+        });
+    });
+}
+
 - (BOOL)silent {
     return (_alert == nil);
 }
@@ -192,47 +595,283 @@
     if ([_payloadType caseInsensitiveCompare: @"application/json"] == NSOrderedSame) {
         NSError* jsonError;
         
-        NSData* jsonData = [NSJSONSerialization dataWithJSONObject: _payload options: 0 error: &jsonError];
+        NSData* jsonData = [NSJSONSerialization dataWithJSONObject: self.payload options: 0 error: &jsonError];
         
         if (jsonData && !jsonError) {
             return [[NSString alloc] initWithData: jsonData encoding: NSUTF8StringEncoding];
         }
     }
 
-    return [_payload description];
+    return [self.payload description];
+}
+
++ (NSUInteger)parallelDecodeThreshold {
+    return _parallelDecodeThreshold;
 }
 
-+ (NSString*)hashPayload:(NSData*)payload {
++ (void)setParallelDecodeThreshold:(NSUInteger)threshold {
+    _parallelDecodeThreshold = threshold;
+}
+
++ (NSData*)decodeBase64:(NSString*)encoded withDigest:(const unsigned char*)digest {
+    
+    // Decode and hash in a single pass over the encoded string, one chunk at a time
+    NSUInteger length = encoded.length;
+    NSMutableData* output = [[NSMutableData alloc] initWithLength: ((length + 3) / 4) * 3];
+    unsigned char* out = output.mutableBytes;
+    NSUInteger outLength = 0;
+    
+    char chunk[BASE64_CHUNK_SIZE];
+    NSRange remaining = NSMakeRange(0, length);
     
-    unsigned int outputLength = CC_SHA1_DIGEST_LENGTH;
-    unsigned char output[outputLength];
+    uint32_t quantum = 0;
+    int count = 0;
+    int padding = 0;
     
-    CC_SHA1(payload.bytes, (unsigned int) payload.length, output);
+    CC_SHA1_CTX ctx;
+    
+    if (digest) {
+        CC_SHA1_Init(&ctx);
+    }
+    
+    while (remaining.length > 0) {
+        NSUInteger used = 0;
+        NSUInteger start = outLength;
+        
+        [encoded getBytes: chunk
+                maxLength: BASE64_CHUNK_SIZE
+               usedLength: &used
+                 encoding: NSASCIIStringEncoding
+                  options: 0
+                    range: remaining
+           remainingRange: &remaining];
+        
+        // not ascii, so not base64
+        if (used == 0) {
+            return nil;
+        }
+        
+        for (NSUInteger i = 0; i < used; i++) {
+            unsigned char c = (unsigned char)chunk[i];
+            
+            if (c == '=') {
+                if (++padding > 2) {
+                    return nil;
+                }
+                quantum <<= 6;
+            }
+            else {
+                int value = QwasiBase64Value(c);
+                
+                if (value < 0 || padding) {
+                    return nil;
+                }
+                quantum = (quantum << 6) | (uint32_t)value;
+            }
+            
+            if (++count == 4) {
+                out[outLength++] = (quantum >> 16) & 0xff;
+                
+                if (padding < 2) {
+                    out[outLength++] = (quantum >> 8) & 0xff;
+                }
+                if (padding < 1) {
+                    out[outLength++] = quantum & 0xff;
+                }
+                
+                quantum = 0;
+                count = 0;
+            }
+        }
+        
+        // tolerate unpadded input, but '=' only ever ends a full quantum
+        if (remaining.length == 0 && count > 0) {
+            if (count == 1 || padding) {
+                return nil;
+            }
+            
+            quantum <<= 6 * (4 - count);
+            
+            out[outLength++] = (quantum >> 16) & 0xff;
+            
+            if (count == 3) {
+                out[outLength++] = (quantum >> 8) & 0xff;
+            }
+        }
+        
+        if (digest) {
+            CC_SHA1_Update(&ctx, out + start, (CC_LONG)(outLength - start));
+        }
+    }
+    
+    if (digest) {
+        unsigned char actual[CC_SHA1_DIGEST_LENGTH];
+        
+        CC_SHA1_Final(actual, &ctx);
+        
+        if (memcmp(actual, digest, CC_SHA1_DIGEST_LENGTH) != 0) {
+            return nil;
+        }
+    }
+    
+    output.length = outLength;
+    
+    return output;
+}
 
-    NSMutableString* hash = [NSMutableString stringWithCapacity:outputLength * 2];
++ (NSData*)compressPayloadData:(NSData*)data {
     
-    for (unsigned int i = 0; i < outputLength; i++) {
-        [hash appendFormat:@"%02x", output[i]];
-        output[i] = 0;
+    if (!data) {
+        return nil;
     }
     
-    return hash;
+    z_stream stream;
+    
+    memset(&stream, 0, sizeof(stream));
+    
+    // windowBits + 16 writes a gzip header and trailer
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return nil;
+    }
+    
+    NSMutableData* output = [[NSMutableData alloc] initWithLength: deflateBound(&stream, data.length) + 18];
+    
+    stream.next_in = (Bytef*)data.bytes;
+    stream.avail_in = (uInt)data.length;
+    stream.next_out = output.mutableBytes;
+    stream.avail_out = (uInt)output.length;
+    
+    int status = deflate(&stream, Z_FINISH);
+    
+    output.length = stream.total_out;
+    
+    deflateEnd(&stream);
+    
+    return (status == Z_STREAM_END) ? output : nil;
+}
+
++ (NSData*)inflatePayloadData:(NSData*)data {
+    return [self inflatePayloadData: data maxLength: INFLATE_MAX_LENGTH];
 }
 
-+ (id)decodePayload:(NSString*)encodedPayload withSHA:(NSString*)sha withType:(NSString*)type {
++ (NSData*)inflatePayloadData:(NSData*)data maxLength:(NSUInteger)maxLength {
     
-    NSData* payloadData = [[NSData alloc] initWithBase64EncodedString: encodedPayload options: 0];
+    if (data.length == 0 || maxLength == 0) {
+        return nil;
+    }
     
-    id rval = nil;
+    z_stream stream;
     
-    if (!payloadData) {
+    memset(&stream, 0, sizeof(stream));
+    
+    // windowBits + 32 accepts both gzip and zlib headers
+    if (inflateInit2(&stream, MAX_WBITS + 32) != Z_OK) {
+        return nil;
+    }
+    
+    const uint8_t* bytes = data.bytes;
+    NSUInteger capacity = data.length * 4;
+    
+    // gzip records the inflated size mod 2^32 in its trailer, use it to size the buffer once
+    if (data.length > 18 && bytes[0] == 0x1f && bytes[1] == 0x8b) {
+        uint32_t size;
+        
+        memcpy(&size, bytes + data.length - 4, sizeof(size));
+        size = CFSwapInt32LittleToHost(size);
+        
+        if (size > 0 && size <= INFLATE_MAX_PRESIZE) {
+            capacity = size;
+        }
+    }
+    
+    // one byte of headroom past the limit tells a stream that ends exactly there from one that keeps going
+    NSUInteger limit = maxLength + 1;
+    NSMutableData* output = [[NSMutableData alloc] initWithLength: MIN(MAX(capacity, INFLATE_CHUNK_SIZE), limit)];
+    int status = Z_OK;
+    
+    stream.next_in = (Bytef*)bytes;
+    stream.avail_in = (uInt)data.length;
+    
+    while (status == Z_OK) {
+        if (stream.total_out >= output.length) {
+            if (output.length >= limit) {
+                break;
+            }
+            
+            [output increaseLengthBy: MIN(MAX(INFLATE_CHUNK_SIZE, output.length / 2), limit - output.length)];
+        }
+        
+        stream.next_out = (Bytef*)output.mutableBytes + stream.total_out;
+        stream.avail_out = (uInt)(output.length - stream.total_out);
+        
+        status = inflate(&stream, Z_NO_FLUSH);
+        
+        if (status == Z_BUF_ERROR && stream.avail_out == 0) {
+            status = Z_OK;
+        }
+    }
+    
+    inflateEnd(&stream);
+    
+    // a few bytes that inflate to more than the limit are a decompression bomb, not a payload
+    if (status != Z_STREAM_END || stream.total_out > maxLength) {
         return nil;
     }
     
-    if (sha && ![sha isEqualToString: [self hashPayload: payloadData]]) {
+    output.length = stream.total_out;
+    
+    return output;
+}
+
++ (NSString*)payloadType:(NSString*)type withoutEncoding:(NSString**)encoding {
+    
+    // content encoding can also ride on the type, application/json+gzip
+    for (NSString* suffix in @[ @"+gzip", @"+deflate" ]) {
+        if ([type.lowercaseString hasSuffix: suffix]) {
+            *encoding = [suffix substringFromIndex: 1];
+            
+            return [type substringToIndex: type.length - suffix.length];
+        }
+    }
+    
+    return type;
+}
+
++ (id)payloadWithData:(NSData*)payloadData withType:(NSString*)type encoding:(NSString*)encoding forKey:(NSString*)key maxPixelSize:(CGFloat)maxPixelSize {
+    
+    type = [self payloadType: type withoutEncoding: &encoding];
+    
+    if ([encoding caseInsensitiveCompare: @"gzip"] == NSOrderedSame || [encoding caseInsensitiveCompare: @"deflate"] == NSOrderedSame) {
+        payloadData = [self inflatePayloadData: payloadData];
+        
+        if (!payloadData) {
+            NSLog(@"Failed to inflate %@ payload.", encoding);
+            return nil;
+        }
+    }
+    
+    return [self payloadWithData: payloadData withType: type forKey: key maxPixelSize: maxPixelSize];
+}
+
++ (id)decodePayload:(NSString*)encodedPayload withType:(NSString*)type encoding:(NSString*)encoding maxPixelSize:(CGFloat)maxPixelSize {
+    
+    if (![encodedPayload isKindOfClass: [NSString class]]) {
         return nil;
     }
     
+    NSData* payloadData = [self decodeBase64: encodedPayload withDigest: NULL];
+    
+    if (!payloadData) {
+        return nil;
+    }
+    
+    return [self payloadWithData: payloadData withType: type encoding: encoding forKey: nil maxPixelSize: maxPixelSize];
+}
+
++ (id)payloadWithData:(NSData*)payloadData withType:(NSString*)type forKey:(NSString*)key maxPixelSize:(CGFloat)maxPixelSize {
+    
+    id rval = nil;
+    
     if ([type caseInsensitiveCompare: @"application/vnd.qwasi.aim+json"] == NSOrderedSame) {
         NSError* jsonError;
         
@@ -240,19 +879,24 @@
         
         if (!jsonError) {
             if ([_payload isKindOfClass:[NSDictionary class]]) {
+                NSArray* keys = [_payload allKeys];
+                NSArray* parts = [self decodeParts: [_payload objectsForKeys: keys notFoundMarker: [NSNull null]] maxPixelSize: maxPixelSize];
+                
                 rval = [[NSMutableDictionary alloc] init];
                 
-                for (NSString* key in _payload) {
-                    id sub = [_payload objectForKey: key];
-                    
-                    rval[key] = [self decodePayload: sub[@"payload"] withSHA: nil withType: sub[@"payload_type"]];
-                }
+                [keys enumerateObjectsUsingBlock:^(NSString* key, NSUInteger idx, BOOL *stop) {
+                    if (parts[idx] != [NSNull null]) {
+                        rval[key] = parts[idx];
+                    }
+                }];
             }
             else if ([_payload isKindOfClass: [NSArray class]]) {
                 rval = [[NSMutableArray alloc] init];
                 
-                for (NSDictionary* sub in _payload) {
-                    [rval addObject: [self decodePayload: sub[@"payload"] withSHA: nil withType: sub[@"payload_type"]]];
+                for (id part in [self decodeParts: _payload maxPixelSize: maxPixelSize]) {
+                    if (part != [NSNull null]) {
+                        [rval addObject: part];
+                    }
                 }
             }
             else {
@@ -271,7 +915,7 @@
         }
     }
     else if ([type rangeOfString: @"image/"].location != NSNotFound) {
-        rval = [[UIImage alloc] initWithData: payloadData];
+        rval = [[QwasiImageDecoder shared] imageWithData: payloadData maxPixelSize: maxPixelSize forKey: key];
         
         if (!rval) {
             rval = payloadData;
@@ -287,6 +931,48 @@
     return rval;
 }
 
++ (NSArray*)decodeParts:(NSArray*)parts maxPixelSize:(CGFloat)maxPixelSize {
+    
+    NSUInteger count = parts.count;
+    NSUInteger size = 0;
+    NSMutableArray* results = [[NSMutableArray alloc] initWithCapacity: count];
+    
+    for (id sub in parts) {
+        if ([sub isKindOfClass: [NSDictionary class]] && [sub[@"payload"] isKindOfClass: [NSString class]]) {
+            size += [sub[@"payload"] length];
+        }
+        
+        [results addObject: [NSNull null]];
+    }
+    
+    void (^decode)(size_t) = ^(size_t idx) {
+        id sub = parts[idx];
+        
+        if ([sub isKindOfClass: [NSDictionary class]]) {
+            NSString* encoding = [sub[@"payload_encoding"] isKindOfClass: [NSString class]] ? sub[@"payload_encoding"] : nil;
+            id part = [self decodePayload: sub[@"payload"] withType: sub[@"payload_type"] encoding: encoding maxPixelSize: maxPixelSize];
+            
+            if (part) {
+                @synchronized(results) {
+                    results[idx] = part;
+                }
+            }
+        }
+    };
+    
+    // Small messages aren't worth the dispatch overhead, decode those in place
+    if (count > 1 && size >= _parallelDecodeThreshold) {
+        dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), decode);
+    }
+    else {
+        for (size_t idx = 0; idx < count; idx++) {
+            decode(idx);
+        }
+    }
+    
+    return results;
+}
+
 - (BOOL)valid {
     return YES;
 }
@@ -0,0 +1,196 @@
+//
+//  QwasiMessageIndex.m
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "QwasiMessageIndex.h"
+
+#define MESSAGE_INDEX_MAGIC "QWI"
+#define MESSAGE_INDEX_VERSION 2
+#define MESSAGE_INDEX_CAPACITY 512
+
+@implementation QwasiMessageIndex {
+    NSMutableOrderedSet* _recent;
+    dispatch_queue_t _queue;
+    BOOL _dirty;
+}
+
++ (instancetype)defaultIndex {
+    static dispatch_once_t once;
+    static id sharedInstance = nil;
+    
+    dispatch_once(&once, ^{
+        // alongside messages.sqlite, a purged record would let deliveries repeat
+        NSURL* support = [[[NSFileManager defaultManager] URLsForDirectory: NSApplicationSupportDirectory inDomains: NSUserDomainMask] lastObject];
+        NSURL* dir = [support URLByAppendingPathComponent: @"Qwasi" isDirectory: YES];
+        
+        [[NSFileManager defaultManager] createDirectoryAtURL: dir withIntermediateDirectories: YES attributes: nil error: nil];
+        
+        sharedInstance = [[QwasiMessageIndex alloc] initWithPath: [dir URLByAppendingPathComponent: @"messages.idx"].path
+                                                        capacity: MESSAGE_INDEX_CAPACITY];
+    });
+    
+    return sharedInstance;
+}
+
+- (id)initWithPath:(NSString*)path capacity:(NSUInteger)capacity {
+    if (self = [super init]) {
+        _path = path;
+        _capacity = MAX(capacity, 1);
+        _queue = dispatch_queue_create("com.qwasi.messageindex", DISPATCH_QUEUE_SERIAL);
+        _recent = [[NSMutableOrderedSet alloc] initWithCapacity: _capacity];
+        
+        [self load];
+    }
+    return self;
+}
+
+#pragma mark - Index
+- (BOOL)insert:(NSString*)key {
+    BOOL found = [_recent containsObject: key];
+    
+    if (found) {
+        [_recent removeObject: key];
+    }
+    
+    [_recent addObject: key];
+    
+    if (_recent.count > _capacity) {
+        [_recent removeObjectAtIndex: 0];
+    }
+    
+    [self setNeedsSave];
+    
+    return !found;
+}
+
+- (BOOL)containsMessageId:(NSString*)messageId {
+    if (!messageId) return NO;
+    
+    __block BOOL found;
+    
+    dispatch_sync(_queue, ^{
+        found = [_recent containsObject: messageId];
+    });
+    
+    return found;
+}
+
+- (BOOL)markDelivered:(QwasiMessage*)message {
+    if (!message.messageId) return YES;
+    
+    NSString* key = message.selected ? [message.messageId stringByAppendingString: @"/selected"] : message.messageId;
+    __block BOOL inserted;
+    
+    dispatch_sync(_queue, ^{
+        inserted = [self insert: key];
+        
+        if (message.selected) {
+            [self insert: message.messageId];
+        }
+    });
+    
+    return inserted;
+}
+
+- (void)removeAllMessageIds {
+    dispatch_sync(_queue, ^{
+        [_recent removeAllObjects];
+        
+        [self setNeedsSave];
+    });
+}
+
+#pragma mark - Persistence
+- (void)setNeedsSave {
+    if (_dirty) return;
+    
+    _dirty = YES;
+    
+    // written as soon as the queue is free, deliveries in the same burst share the write
+    dispatch_async(_queue, ^{
+        _dirty = NO;
+        
+        [self save];
+    });
+}
+
+- (void)save {
+    NSMutableData* data = [[NSMutableData alloc] initWithCapacity: 4 + _recent.count * 24];
+    uint8_t version = MESSAGE_INDEX_VERSION;
+    
+    [data appendBytes: MESSAGE_INDEX_MAGIC length: 3];
+    [data appendBytes: &version length: 1];
+    
+    for (NSString* key in _recent) {
+        NSData* utf8 = [key dataUsingEncoding: NSUTF8StringEncoding];
+        uint16_t length = CFSwapInt16HostToLittle((uint16_t)MIN(utf8.length, UINT16_MAX));
+        
+        [data appendBytes: &length length: sizeof(length)];
+        [data appendBytes: utf8.bytes length: CFSwapInt16LittleToHost(length)];
+    }
+    
+    NSError* error;
+    
+    if (![data writeToFile: _path options: NSDataWritingAtomic error: &error]) {
+        NSLog(@"Failed to save message index %@: %@", _path, error);
+    }
+}
+
+- (void)load {
+    NSData* data = [NSData dataWithContentsOfFile: _path options: NSDataReadingMappedIfSafe error: nil];
+    const uint8_t* bytes = data.bytes;
+    NSUInteger header = 4;
+    
+    if (data.length < header || memcmp(bytes, MESSAGE_INDEX_MAGIC, 3) != 0 || bytes[3] != MESSAGE_INDEX_VERSION) {
+        return;
+    }
+    
+    NSUInteger offset = header;
+    
+    while (offset + sizeof(uint16_t) <= data.length) {
+        uint16_t length;
+        
+        memcpy(&length, bytes + offset, sizeof(length));
+        length = CFSwapInt16LittleToHost(length);
+        offset += sizeof(length);
+        
+        if (offset + length > data.length) break;
+        
+        NSString* key = [[NSString alloc] initWithBytes: bytes + offset length: length encoding: NSUTF8StringEncoding];
+        
+        if (key) {
+            [_recent addObject: key];
+        }
+        
+        offset += length;
+    }
+    
+    while (_recent.count > _capacity) {
+        [_recent removeObjectAtIndex: 0];
+    }
+}
+@end
@@ -0,0 +1,85 @@
+//
+//  QwasiMessageStore.h
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import <Foundation/Foundation.h>
+
+#import "QwasiMessage.h"
+
+@interface QwasiMessageStore : NSObject
+
+@property (nonatomic,readonly) NSString* path;
+
+/** Newest messages kept on disk, older ones are pruned after each store and at launch. Default 1000, 0 means no limit. */
+@property (nonatomic,readwrite) NSUInteger maxMessageCount;
+
+/** Messages created longer ago than this are pruned. Default 0, no age limit. */
+@property (nonatomic,readwrite) NSTimeInterval maxMessageAge;
+
+/** Number of message archives kept in the in-memory tier */
+@property (nonatomic,readwrite) NSUInteger hotCountLimit;
+
+/** Byte budget for the in-memory tier, each entry is charged its archived size. 0 means no limit. */
+@property (nonatomic,readwrite) NSUInteger hotCostLimit;
+
+/** In-memory tier counters, use them to size the limits for a device class */
+@property (nonatomic,readonly) NSUInteger hotHits;
+@property (nonatomic,readonly) NSUInteger hotMisses;
+@property (nonatomic,readonly) NSUInteger hotEvictions;
+@property (nonatomic,readonly) NSUInteger hotBytes;
+
+/** Returns the shared on-disk store in Application Support */
++ (instancetype)defaultStore;
+
+- (id)initWithPath:(NSString*)path;
+
+- (void)resetHotStatistics;
+
+- (void)storeMessage:(QwasiMessage*)message;
+
+- (BOOL)containsMessage:(NSString*)messageId;
+
+- (QwasiMessage*)messageForId:(NSString*)messageId;
+
+- (QwasiMessage*)messageForId:(NSString*)messageId updateFlags:(BOOL)update;
+
+/** Pages back through history, newest first. Pass nil to start at the most recent message. */
+- (NSArray*)messagesBefore:(QwasiMessage*)message limit:(NSUInteger)limit;
+
+- (NSArray*)messagesWithTag:(NSString*)tag before:(QwasiMessage*)message limit:(NSUInteger)limit;
+
+- (NSArray*)unreadMessagesBefore:(QwasiMessage*)message limit:(NSUInteger)limit;
+
+- (void)markMessage:(NSString*)messageId read:(BOOL)read;
+
+- (void)removeMessage:(NSString*)messageId;
+
+/** Applies maxMessageCount and maxMessageAge now */
+- (void)pruneMessages;
+
+- (void)removeAllMessages;
+@end
@@ -0,0 +1,539 @@
+//
+//  QwasiMessageStore.m
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "QwasiMessageStore.h"
+#import <sqlite3.h>
+
+#define MESSAGE_STORE_VERSION 1
+#define MESSAGE_STORE_HOT_COUNT 64
+#define MESSAGE_STORE_HOT_COST (1024 * 1024)
+#define MESSAGE_STORE_MAX_COUNT 1000
+
+static void QwasiBindText(sqlite3_stmt* stmt, int idx, NSString* text) {
+    if (text) {
+        sqlite3_bind_text(stmt, idx, text.UTF8String, -1, SQLITE_TRANSIENT);
+    }
+    else {
+        sqlite3_bind_null(stmt, idx);
+    }
+}
+
+// Hot tier entry, charged at the archive's byte size
+@interface QwasiHotArchive : NSObject
+@property (nonatomic,strong) NSData* archive;
+@property (nonatomic,assign) BOOL removed;
+@end
+
+@implementation QwasiHotArchive
+@end
+
+@interface QwasiMessageStore () <NSCacheDelegate>
+@end
+
+@implementation QwasiMessageStore {
+    sqlite3* _db;
+    dispatch_queue_t _queue;
+    NSMutableDictionary* _statements;
+    NSCache* _hot;
+    BOOL _clearing;
+}
+
++ (instancetype)defaultStore {
+    static dispatch_once_t once;
+    static id sharedInstance = nil;
+    
+    dispatch_once(&once, ^{
+        NSURL* support = [[[NSFileManager defaultManager] URLsForDirectory: NSApplicationSupportDirectory inDomains: NSUserDomainMask] lastObject];
+        NSURL* dir = [support URLByAppendingPathComponent: @"Qwasi" isDirectory: YES];
+        
+        [[NSFileManager defaultManager] createDirectoryAtURL: dir withIntermediateDirectories: YES attributes: nil error: nil];
+        [dir setResourceValue: @YES forKey: NSURLIsExcludedFromBackupKey error: nil];
+        
+        sharedInstance = [[QwasiMessageStore alloc] initWithPath: [dir URLByAppendingPathComponent: @"messages.sqlite"].path];
+    });
+    
+    return sharedInstance;
+}
+
+- (id)initWithPath:(NSString*)path {
+    if (self = [super init]) {
+        _path = path;
+        _queue = dispatch_queue_create("com.qwasi.messagestore", DISPATCH_QUEUE_SERIAL);
+        _statements = [[NSMutableDictionary alloc] init];
+        _maxMessageCount = MESSAGE_STORE_MAX_COUNT;
+        _maxMessageAge = 0;
+        
+        _hot = [[NSCache alloc] init];
+        _hot.name = @"com.qwasi.messagestore.hot";
+        _hot.countLimit = MESSAGE_STORE_HOT_COUNT;
+        _hot.totalCostLimit = MESSAGE_STORE_HOT_COST;
+        _hot.delegate = self;
+        
+        if (sqlite3_open_v2(path.fileSystemRepresentation, &_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+            NSLog(@"Failed to open message store %@: %s", path, sqlite3_errmsg(_db));
+            
+            sqlite3_close(_db);
+            _db = NULL;
+        }
+        else {
+            [self migrate];
+            
+            // history left over from before a limit was lowered
+            [self pruneMessages];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    for (NSValue* stmt in _statements.allValues) {
+        sqlite3_finalize(stmt.pointerValue);
+    }
+    
+    if (_db) {
+        sqlite3_close(_db);
+    }
+}
+
+- (NSUInteger)hotCountLimit {
+    return _hot.countLimit;
+}
+
+- (void)setHotCountLimit:(NSUInteger)hotCountLimit {
+    _hot.countLimit = hotCountLimit;
+}
+
+- (NSUInteger)hotCostLimit {
+    return _hot.totalCostLimit;
+}
+
+- (void)setHotCostLimit:(NSUInteger)hotCostLimit {
+    _hot.totalCostLimit = hotCostLimit;
+}
+
+- (void)resetHotStatistics {
+    @synchronized(self) {
+        _hotHits = 0;
+        _hotMisses = 0;
+        _hotEvictions = 0;
+    }
+}
+
+#pragma mark - Hot tier
+- (NSData*)hotArchiveForId:(NSString*)messageId {
+    QwasiHotArchive* entry = [_hot objectForKey: messageId];
+    
+    @synchronized(self) {
+        if (entry) {
+            _hotHits++;
+        }
+        else {
+            _hotMisses++;
+        }
+    }
+    
+    return entry.archive;
+}
+
+- (void)setHotArchive:(NSData*)archive forId:(NSString*)messageId {
+    QwasiHotArchive* entry = [[QwasiHotArchive alloc] init];
+    
+    entry.archive = archive;
+    
+    // NSCache does not report replaced objects, so drop the old entry first to keep the byte count honest
+    [self removeHotArchiveForId: messageId];
+    
+    @synchronized(self) {
+        _hotBytes += archive.length;
+    }
+    
+    [_hot setObject: entry forKey: messageId cost: archive.length];
+}
+
+- (void)removeHotArchiveForId:(NSString*)messageId {
+    QwasiHotArchive* entry = [_hot objectForKey: messageId];
+    
+    if (entry) {
+        entry.removed = YES;
+        
+        [_hot removeObjectForKey: messageId];
+    }
+}
+
+- (void)cache:(NSCache *)cache willEvictObject:(id)obj {
+    QwasiHotArchive* entry = obj;
+    
+    @synchronized(self) {
+        _hotBytes -= MIN(_hotBytes, entry.archive.length);
+        
+        if (!entry.removed && !_clearing) {
+            _hotEvictions++;
+        }
+    }
+}
+
+#pragma mark - SQLite
+- (void)exec:(NSString*)sql {
+    char* err = NULL;
+    
+    if (sqlite3_exec(_db, sql.UTF8String, NULL, NULL, &err) != SQLITE_OK) {
+        NSLog(@"Message store error %s in %@", err, sql);
+        
+        sqlite3_free(err);
+    }
+}
+
+- (void)migrate {
+    [self exec: @"PRAGMA journal_mode = WAL"];
+    
+    sqlite3_stmt* stmt = [self statement: @"PRAGMA user_version"];
+    int version = (sqlite3_step(stmt) == SQLITE_ROW) ? sqlite3_column_int(stmt, 0) : 0;
+    
+    sqlite3_reset(stmt);
+    
+    if (version < 1) {
+        [self exec: @"BEGIN"];
+        [self exec: @"CREATE TABLE IF NOT EXISTS messages ("
+                     "id TEXT PRIMARY KEY NOT NULL, "
+                     "timestamp REAL NOT NULL, "
+                     "read INTEGER NOT NULL DEFAULT 0, "
+                     "archive BLOB NOT NULL)"];
+        [self exec: @"CREATE INDEX IF NOT EXISTS messages_timestamp ON messages (timestamp DESC, id DESC)"];
+        [self exec: @"CREATE INDEX IF NOT EXISTS messages_read ON messages (read, timestamp DESC, id DESC)"];
+        [self exec: @"CREATE TABLE IF NOT EXISTS message_tags ("
+                     "tag TEXT NOT NULL, "
+                     "message_id TEXT NOT NULL, "
+                     "timestamp REAL NOT NULL, "
+                     "PRIMARY KEY (tag, message_id))"];
+        [self exec: @"CREATE INDEX IF NOT EXISTS message_tags_timestamp ON message_tags (tag, timestamp DESC, message_id DESC)"];
+        [self exec: @"CREATE INDEX IF NOT EXISTS message_tags_message ON message_tags (message_id)"];
+        [self exec: [NSString stringWithFormat: @"PRAGMA user_version = %d", MESSAGE_STORE_VERSION]];
+        [self exec: @"COMMIT"];
+    }
+}
+
+// Prepared statements are cached for the life of the store, callers must reset them
+- (sqlite3_stmt*)statement:(NSString*)sql {
+    NSValue* cached = _statements[sql];
+    
+    if (cached) {
+        return cached.pointerValue;
+    }
+    
+    sqlite3_stmt* stmt = NULL;
+    
+    if (sqlite3_prepare_v2(_db, sql.UTF8String, -1, &stmt, NULL) != SQLITE_OK) {
+        NSLog(@"Message store error %s in %@", sqlite3_errmsg(_db), sql);
+        
+        return NULL;
+    }
+    
+    _statements[sql] = [NSValue valueWithPointer: stmt];
+    
+    return stmt;
+}
+
+#pragma mark - Messages
+- (NSData*)archiveForMessage:(QwasiMessage*)message {
+    return [message archive];
+}
+
+- (void)storeMessage:(QwasiMessage*)message {
+    
+    if (!message.messageId) {
+        return;
+    }
+    
+    NSData* archive = [self archiveForMessage: message];
+    
+    [self setHotArchive: archive forId: message.messageId];
+    
+    dispatch_async(_queue, ^{
+        if (!_db) {
+            return;
+        }
+        
+        [self exec: @"BEGIN"];
+        
+        // a message seen again keeps any read mark it already has, storing only ever sets the flag
+        sqlite3_stmt* stmt = [self statement: @"INSERT INTO messages (id, timestamp, read, archive) VALUES (?, ?, ?, ?) "
+                                               "ON CONFLICT(id) DO UPDATE SET timestamp = excluded.timestamp, read = MAX(read, excluded.read), archive = excluded.archive"];
+        
+        QwasiBindText(stmt, 1, message.messageId);
+        sqlite3_bind_double(stmt, 2, message.timestamp);
+        sqlite3_bind_int(stmt, 3, message.selected ? 1 : 0);
+        sqlite3_bind_blob(stmt, 4, archive.bytes, (int)archive.length, SQLITE_STATIC);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        
+        stmt = [self statement: @"DELETE FROM message_tags WHERE message_id = ?"];
+        
+        QwasiBindText(stmt, 1, message.messageId);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        
+        stmt = [self statement: @"INSERT OR IGNORE INTO message_tags (tag, message_id, timestamp) VALUES (?, ?, ?)"];
+        
+        for (NSString* tag in message.tags) {
+            if ([tag isKindOfClass: [NSString class]]) {
+                QwasiBindText(stmt, 1, tag);
+                QwasiBindText(stmt, 2, message.messageId);
+                sqlite3_bind_double(stmt, 3, message.timestamp);
+                sqlite3_step(stmt);
+                sqlite3_reset(stmt);
+            }
+        }
+        
+        [self exec: @"COMMIT"];
+        
+        [self prune];
+    });
+}
+
+- (NSData*)archiveForId:(NSString*)messageId {
+    
+    if (!messageId) {
+        return nil;
+    }
+    
+    __block NSData* archive = [self hotArchiveForId: messageId];
+    
+    if (!archive) {
+        dispatch_sync(_queue, ^{
+            if (!_db) {
+                return;
+            }
+            
+            sqlite3_stmt* stmt = [self statement: @"SELECT archive FROM messages WHERE id = ?"];
+            
+            QwasiBindText(stmt, 1, messageId);
+            
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                archive = [NSData dataWithBytes: sqlite3_column_blob(stmt, 0) length: sqlite3_column_bytes(stmt, 0)];
+            }
+            
+            sqlite3_reset(stmt);
+        });
+        
+        if (archive) {
+            [self setHotArchive: archive forId: messageId];
+        }
+    }
+    
+    return archive;
+}
+
+- (BOOL)containsMessage:(NSString*)messageId {
+    return [self archiveForId: messageId] != nil;
+}
+
+- (QwasiMessage*)messageForId:(NSString*)messageId {
+    return [self messageForId: messageId updateFlags: NO];
+}
+
+- (QwasiMessage*)messageForId:(NSString*)messageId updateFlags:(BOOL)update {
+    NSData* archive = [self archiveForId: messageId];
+    
+    return archive ? [QwasiMessage messageWithArchive: archive updateFlags: update] : nil;
+}
+
+// Keyset paging on (timestamp, id) so deep pages cost the same as the first
+- (NSArray*)messagesWhere:(NSString*)where tag:(NSString*)tag before:(QwasiMessage*)message limit:(NSUInteger)limit {
+    
+    NSMutableArray* messages = [[NSMutableArray alloc] init];
+    NSMutableArray* archives = [[NSMutableArray alloc] init];
+    
+    NSString* sql;
+    
+    if (tag) {
+        sql = [NSString stringWithFormat: @"SELECT m.id, m.archive FROM message_tags t JOIN messages m ON m.id = t.message_id "
+               "WHERE t.tag = ?3 AND (?1 IS NULL OR t.timestamp < ?1 OR (t.timestamp = ?1 AND t.message_id < ?2)) %@ "
+               "ORDER BY t.timestamp DESC, t.message_id DESC LIMIT ?4", where];
+    }
+    else {
+        sql = [NSString stringWithFormat: @"SELECT m.id, m.archive FROM messages m "
+               "WHERE (?1 IS NULL OR m.timestamp < ?1 OR (m.timestamp = ?1 AND m.id < ?2)) %@ "
+               "ORDER BY m.timestamp DESC, m.id DESC LIMIT ?4", where];
+    }
+    
+    dispatch_sync(_queue, ^{
+        if (!_db) {
+            return;
+        }
+        
+        sqlite3_stmt* stmt = [self statement: sql];
+        
+        if (message) {
+            sqlite3_bind_double(stmt, 1, message.timestamp);
+        }
+        QwasiBindText(stmt, 2, message.messageId);
+        QwasiBindText(stmt, 3, tag);
+        sqlite3_bind_int64(stmt, 4, (sqlite3_int64)limit);
+        
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            [archives addObject: @[ [NSString stringWithUTF8String: (const char*)sqlite3_column_text(stmt, 0)],
+                                    [NSData dataWithBytes: sqlite3_column_blob(stmt, 1) length: sqlite3_column_bytes(stmt, 1)] ]];
+        }
+        
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    });
+    
+    for (NSArray* row in archives) {
+        QwasiMessage* msg = [QwasiMessage messageWithArchive: row[1] updateFlags: NO];
+        
+        if (msg) {
+            [self setHotArchive: row[1] forId: row[0]];
+            [messages addObject: msg];
+        }
+    }
+    
+    return messages;
+}
+
+- (NSArray*)messagesBefore:(QwasiMessage*)message limit:(NSUInteger)limit {
+    return [self messagesWhere: @"" tag: nil before: message limit: limit];
+}
+
+- (NSArray*)messagesWithTag:(NSString*)tag before:(QwasiMessage*)message limit:(NSUInteger)limit {
+    return [self messagesWhere: @"" tag: tag before: message limit: limit];
+}
+
+- (NSArray*)unreadMessagesBefore:(QwasiMessage*)message limit:(NSUInteger)limit {
+    return [self messagesWhere: @"AND m.read = 0" tag: nil before: message limit: limit];
+}
+
+- (void)markMessage:(NSString*)messageId read:(BOOL)read {
+    dispatch_async(_queue, ^{
+        if (!_db) {
+            return;
+        }
+        
+        sqlite3_stmt* stmt = [self statement: @"UPDATE messages SET read = ? WHERE id = ?"];
+        
+        sqlite3_bind_int(stmt, 1, read ? 1 : 0);
+        QwasiBindText(stmt, 2, messageId);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    });
+}
+
+- (void)removeMessage:(NSString*)messageId {
+    
+    if (!messageId) {
+        return;
+    }
+    
+    [self removeHotArchiveForId: messageId];
+    
+    dispatch_async(_queue, ^{
+        if (!_db) {
+            return;
+        }
+        
+        for (NSString* sql in @[ @"DELETE FROM messages WHERE id = ?", @"DELETE FROM message_tags WHERE message_id = ?" ]) {
+            sqlite3_stmt* stmt = [self statement: sql];
+            
+            QwasiBindText(stmt, 1, messageId);
+            sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+        }
+    });
+}
+
+- (void)pruneMessages {
+    dispatch_async(_queue, ^{
+        [self prune];
+    });
+}
+
+// Runs on the store queue
+- (void)prune {
+    NSUInteger maxCount = _maxMessageCount;
+    NSTimeInterval maxAge = _maxMessageAge;
+    NSMutableArray* expired = [[NSMutableArray alloc] init];
+    
+    if (!_db || (!maxCount && maxAge <= 0)) {
+        return;
+    }
+    
+    // everything past the newest maxCount, plus anything older than the cutoff
+    sqlite3_stmt* stmt = [self statement: @"SELECT id FROM messages WHERE (?1 > 0 AND timestamp < ?1) "
+                                           "UNION SELECT id FROM (SELECT id FROM messages ORDER BY timestamp DESC, id DESC LIMIT -1 OFFSET ?2) "
+                                           "WHERE ?2 > 0"];
+    
+    sqlite3_bind_double(stmt, 1, maxAge > 0 ? [[NSDate date] timeIntervalSince1970] - maxAge : 0);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)maxCount);
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        [expired addObject: [NSString stringWithUTF8String: (const char*)sqlite3_column_text(stmt, 0)]];
+    }
+    
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    
+    if (expired.count == 0) {
+        return;
+    }
+    
+    [self exec: @"BEGIN"];
+    
+    for (NSString* messageId in expired) {
+        [self removeHotArchiveForId: messageId];
+        
+        for (NSString* sql in @[ @"DELETE FROM messages WHERE id = ?", @"DELETE FROM message_tags WHERE message_id = ?" ]) {
+            stmt = [self statement: sql];
+            
+            QwasiBindText(stmt, 1, messageId);
+            sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+        }
+    }
+    
+    [self exec: @"COMMIT"];
+}
+
+- (void)removeAllMessages {
+    
+    // not under the lock, NSCache calls the eviction delegate while holding its own
+    _clearing = YES;
+    
+    [_hot removeAllObjects];
+    
+    _clearing = NO;
+    
+    dispatch_async(_queue, ^{
+        if (_db) {
+            [self exec: @"DELETE FROM messages"];
+            [self exec: @"DELETE FROM message_tags"];
+        }
+    });
+}
+@end
@@ -29,8 +29,11 @@
 #import "QwasiNotificationManager.h"
 #import "QwasiError.h"
 #import "QwasiMessage.h"
+#import "QwasiMessageIndex.h"
 #import "NSObject+STSwizzle.h"
 
+#define FETCH_COMPLETION_TIMEOUT 25
+
 typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
 
 @implementation QwasiNotificationManager {
@@ -194,14 +197,49 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
                                    orAddWithTypes:"v@:@@@"
                                    implementation: ^(id _self, UIApplication* _unused, NSDictionary* userInfo, fetchCompletionHander completionHandler)
              {
-                 [self emit: @"notification", userInfo];
+                 // Listeners that fetch in response call defer() and then the returned block when done,
+                 // the system completion handler waits for all of them
+                 dispatch_group_t group = dispatch_group_create();
+                 
+                 dispatch_block_t (^defer)(void) = ^dispatch_block_t {
+                     __block BOOL finished = NO;
+                     
+                     dispatch_group_enter(group);
+                     
+                     return ^{
+                         if (!finished) {
+                             finished = YES;
+                             
+                             dispatch_group_leave(group);
+                         }
+                     };
+                 };
+                 
+                 [self emit: @"notification", userInfo, defer];
+                 
+                 fetchCompletionHander deferredHandler = ^(UIBackgroundFetchResult result) {
+                     __block BOOL called = NO;
+                     
+                     dispatch_block_t complete = ^{
+                         if (!called) {
+                             called = YES;
+                             
+                             if (completionHandler) completionHandler(result);
+                         }
+                     };
+                     
+                     dispatch_group_notify(group, dispatch_get_main_queue(), complete);
+                     
+                     // never hold the handler past the background execution budget
+                     dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(FETCH_COMPLETION_TIMEOUT * NSEC_PER_SEC)), dispatch_get_main_queue(), complete);
+                 };
                  
                  [_self callOnSuper:^{
                      if ([_self respondsToSelector:@selector(application:didReceiveRemoteNotification:fetchCompletionHandler:)]) {
-                         [_self application: application didReceiveRemoteNotification: userInfo fetchCompletionHandler: completionHandler];
+                         [_self application: application didReceiveRemoteNotification: userInfo fetchCompletionHandler: deferredHandler];
                      }
-                     else if (completionHandler) {
-                         completionHandler(UIBackgroundFetchResultNewData);
+                     else {
+                         deferredHandler(UIBackgroundFetchResultNewData);
                      }
                  }];
              }];
@@ -210,10 +248,19 @@ typedef void (^fetchCompletionHander)(UIBackgroundFetchResult result);
                                    orAddWithTypes:"v@:@@@"
                                    implementation: ^(id _self, UIApplication* _unused, UILocalNotification* notification)
              {
-                 if (notification.userInfo && notification.userInfo[@"qwasi"]) {
-                     QwasiMessage* mesage = [NSKeyedUnarchiver unarchiveObjectWithData: notification.userInfo[@"qwasi"]];
+                 id qwasi = notification.userInfo[@"qwasi"];
+                 
+                 if ([qwasi isKindOfClass: [NSArray class]]) {
+                     [self emit: @"notification", notification.userInfo, nil];
+                 }
+                 else if ([qwasi isKindOfClass: [NSData class]]) {
+                     // scheduled by an older version with the whole message archived
+                     QwasiMessage* mesage = [QwasiMessage messageWithArchive: qwasi updateFlags: YES];
                      
-                     [self emit: @"message", mesage];
+                     // a local notification firing in the foreground repeats a message already delivered
+                     if ([[QwasiMessageIndex defaultIndex] markDelivered: mesage]) {
+                         [self emit: @"message", mesage];
+                     }
                  }
                  
                  [_self callOnSuper:^{
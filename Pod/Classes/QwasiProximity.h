@@ -0,0 +1,51 @@
+//
+//  QwasiProximity.h
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+
+/** Distances from one fix to a fixed set of points in a single vectorized pass. Coordinates are held
+ as parallel arrays and run through a haversine kernel on Accelerate, which agrees with
+ -distanceFromLocation: to within about 0.5%. */
+@interface QwasiProximity : NSObject
+
+@property (nonatomic,readonly) NSArray* locations;
+@property (nonatomic,readonly) NSUInteger count;
+
+/** Geofences carry their radius so edge distances can be computed, any other location is a point */
+- (id)initWithLocations:(NSArray*)locations;
+
+/** Fills distances, which must hold count values, with meters from location to each center */
+- (void)distancesFrom:(CLLocation*)location into:(double*)distances;
+
+/** Same as -distancesFrom:into: less each radius, clamped at 0 for points inside */
+- (void)edgeDistancesFrom:(CLLocation*)location into:(double*)distances;
+
+/** Index of the closest edge, NSNotFound if empty. distance, if given, receives the meters to it. */
+- (NSUInteger)nearestEdgeTo:(CLLocation*)location distance:(CLLocationDistance*)distance;
+@end
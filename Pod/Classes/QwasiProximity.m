@@ -0,0 +1,154 @@
+//
+//  QwasiProximity.m
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "QwasiProximity.h"
+#import "QwasiLocation.h"
+
+#import <Accelerate/Accelerate.h>
+
+#define PROXIMITY_EARTH_RADIUS 6371008.8
+#define PROXIMITY_RADIANS (M_PI / 180.0)
+
+@implementation QwasiProximity {
+    // structure of arrays so each step of the kernel streams one contiguous buffer
+    double* _lat;
+    double* _lng;
+    double* _cosLat;
+    double* _radius;
+    double* _scratch;
+}
+
+- (id)initWithLocations:(NSArray*)locations {
+    if (self = [super init]) {
+        _locations = [locations copy];
+        _count = _locations.count;
+        
+        size_t size = MAX(_count, 1) * sizeof(double);
+        
+        _lat = malloc(size);
+        _lng = malloc(size);
+        _cosLat = malloc(size);
+        _radius = malloc(size);
+        _scratch = malloc(size);
+        
+        for (NSUInteger i = 0; i < _count; i++) {
+            CLLocation* location = _locations[i];
+            
+            _lat[i] = location.coordinate.latitude * PROXIMITY_RADIANS;
+            _lng[i] = location.coordinate.longitude * PROXIMITY_RADIANS;
+            _cosLat[i] = cos(_lat[i]);
+            
+            if ([location isKindOfClass: [QwasiLocation class]] && ((QwasiLocation*)location).type == QwasiLocationTypeGeofence) {
+                _radius[i] = ((QwasiLocation*)location).geofenceRadius;
+            }
+            else {
+                _radius[i] = 0;
+            }
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    free(_lat);
+    free(_lng);
+    free(_cosLat);
+    free(_radius);
+    free(_scratch);
+}
+
+- (void)distancesFrom:(CLLocation*)location into:(double*)distances {
+    if (_count == 0) {
+        return;
+    }
+    
+    @synchronized(self) {
+        int n = (int)_count;
+        vDSP_Length length = _count;
+        double lat = location.coordinate.latitude * PROXIMITY_RADIANS;
+        double lng = location.coordinate.longitude * PROXIMITY_RADIANS;
+        double cosLat = cos(lat);
+        double half = 0.5, zero = 0, one = 1, scale = 2 * PROXIMITY_EARTH_RADIUS;
+        double latOffset = -0.5 * lat, lngOffset = -0.5 * lng;
+        double* hav = distances;
+        
+        // sin^2((lat_i - lat) / 2)
+        vDSP_vsmsaD(_lat, 1, &half, &latOffset, hav, 1, length);
+        vvsin(hav, hav, &n);
+        vDSP_vsqD(hav, 1, hav, 1, length);
+        
+        // + cos(lat) * cos(lat_i) * sin^2((lng_i - lng) / 2)
+        vDSP_vsmsaD(_lng, 1, &half, &lngOffset, _scratch, 1, length);
+        vvsin(_scratch, _scratch, &n);
+        vDSP_vsqD(_scratch, 1, _scratch, 1, length);
+        vDSP_vmulD(_scratch, 1, _cosLat, 1, _scratch, 1, length);
+        vDSP_vsmaD(_scratch, 1, &cosLat, hav, 1, hav, 1, length);
+        
+        // 2R * asin(sqrt(h)), rounding can push h a hair past 1 for antipodal points
+        vDSP_vclipD(hav, 1, &zero, &one, hav, 1, length);
+        vvsqrt(hav, hav, &n);
+        vvasin(hav, hav, &n);
+        vDSP_vsmulD(hav, 1, &scale, distances, 1, length);
+    }
+}
+
+- (void)edgeDistancesFrom:(CLLocation*)location into:(double*)distances {
+    if (_count == 0) {
+        return;
+    }
+    
+    double zero = 0;
+    
+    [self distancesFrom: location into: distances];
+    
+    vDSP_vsubD(_radius, 1, distances, 1, distances, 1, _count);
+    vDSP_vthresD(distances, 1, &zero, distances, 1, _count);
+}
+
+- (NSUInteger)nearestEdgeTo:(CLLocation*)location distance:(CLLocationDistance*)distance {
+    if (_count == 0) {
+        return NSNotFound;
+    }
+    
+    double* distances = malloc(_count * sizeof(double));
+    double nearest;
+    vDSP_Length index;
+    
+    [self edgeDistancesFrom: location into: distances];
+    
+    vDSP_minviD(distances, 1, &nearest, &index, _count);
+    
+    free(distances);
+    
+    if (distance) {
+        *distance = nearest;
+    }
+    
+    return (NSUInteger)index;
+}
+@end
@@ -0,0 +1,59 @@
+//
+//  QwasiTrajectory.h
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+
+/** Buffers location fixes into a path segment, so a run of movement can be reported as one
+ simplified, delta-encoded event rather than one event per fix. */
+@interface QwasiTrajectory : NSObject
+
+/** Fixes buffered since the last -removeAllLocations, oldest first */
+@property (nonatomic,readonly) NSArray* locations;
+@property (nonatomic,readonly) NSUInteger count;
+
+/** Time between the first and last buffered fix */
+@property (nonatomic,readonly) NSTimeInterval duration;
+
+/** Largest distance a dropped fix may lie from the simplified path */
+@property (nonatomic,readonly) CLLocationDistance tolerance;
+
+- (id)initWithTolerance:(CLLocationDistance)tolerance;
+
+- (void)addLocation:(CLLocation*)location;
+- (void)removeAllLocations;
+
+/** The buffered fixes reduced with Douglas-Peucker, the first and last are always kept */
+- (NSArray*)simplifiedLocations;
+
+/** Event data for the simplified segment, nil if nothing is buffered. lat and lng are the last fix,
+ the path is an origin at double precision followed by 1e-7 degree and millisecond deltas. */
+- (NSDictionary*)encodedSegment;
+
++ (NSArray*)simplifyLocations:(NSArray*)locations tolerance:(CLLocationDistance)tolerance;
+@end
@@ -0,0 +1,209 @@
+//
+//  QwasiTrajectory.m
+//
+// Copyright (c) 2015-2016, Qwasi Inc (http://www.qwasi.com/)
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of Qwasi nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL QWASI BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "QwasiTrajectory.h"
+
+#define TRAJECTORY_COORDINATE_SCALE 1e7
+#define TRAJECTORY_TIME_SCALE 1e3
+
+@implementation QwasiTrajectory {
+    NSMutableArray* _locations;
+}
+
+- (id)initWithTolerance:(CLLocationDistance)tolerance {
+    if (self = [super init]) {
+        _tolerance = tolerance;
+        _locations = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (NSArray*)locations {
+    return [_locations copy];
+}
+
+- (NSUInteger)count {
+    return _locations.count;
+}
+
+- (NSTimeInterval)duration {
+    if (_locations.count < 2) {
+        return 0;
+    }
+    
+    return [[_locations.lastObject timestamp] timeIntervalSinceDate: [_locations.firstObject timestamp]];
+}
+
+- (void)addLocation:(CLLocation*)location {
+    if (location) {
+        [_locations addObject: location];
+    }
+}
+
+- (void)removeAllLocations {
+    [_locations removeAllObjects];
+}
+
+- (NSArray*)simplifiedLocations {
+    return [QwasiTrajectory simplifyLocations: _locations tolerance: _tolerance];
+}
+
++ (NSArray*)simplifyLocations:(NSArray*)locations tolerance:(CLLocationDistance)tolerance {
+    NSUInteger count = locations.count;
+    
+    if (count < 3) {
+        return [locations copy];
+    }
+    
+    // project onto a local plane in meters, a segment is short enough for equirectangular to hold
+    CLLocationCoordinate2D origin = [locations[0] coordinate];
+    double lngScale = 111320.0 * cos(origin.latitude * M_PI / 180.0);
+    double* x = malloc(count * sizeof(double));
+    double* y = malloc(count * sizeof(double));
+    BOOL* keep = calloc(count, sizeof(BOOL));
+    NSUInteger* stack = malloc(count * 2 * sizeof(NSUInteger));
+    NSUInteger depth = 0;
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        CLLocationCoordinate2D coordinate = [locations[i] coordinate];
+        
+        x[i] = (coordinate.longitude - origin.longitude) * lngScale;
+        y[i] = (coordinate.latitude - origin.latitude) * 110540.0;
+    }
+    
+    keep[0] = keep[count - 1] = YES;
+    
+    // iterative so a long drive can't run the stack out
+    stack[depth++] = 0;
+    stack[depth++] = count - 1;
+    
+    while (depth > 0) {
+        NSUInteger last = stack[--depth];
+        NSUInteger first = stack[--depth];
+        
+        double dx = x[last] - x[first];
+        double dy = y[last] - y[first];
+        double length2 = dx * dx + dy * dy;
+        double farthest = 0;
+        NSUInteger index = 0;
+        
+        for (NSUInteger i = first + 1; i < last; i++) {
+            double px = x[i] - x[first];
+            double py = y[i] - y[first];
+            double distance;
+            
+            if (length2 > 0) {
+                // distance to the segment, not the infinite line, so doubling back is kept
+                double t = MAX(0, MIN(1, (px * dx + py * dy) / length2));
+                double ex = px - t * dx;
+                double ey = py - t * dy;
+                
+                distance = sqrt(ex * ex + ey * ey);
+            }
+            else {
+                distance = sqrt(px * px + py * py);
+            }
+            
+            if (distance > farthest) {
+                farthest = distance;
+                index = i;
+            }
+        }
+        
+        if (farthest > tolerance) {
+            keep[index] = YES;
+            
+            stack[depth++] = first;
+            stack[depth++] = index;
+            stack[depth++] = index;
+            stack[depth++] = last;
+        }
+    }
+    
+    NSMutableArray* simplified = [[NSMutableArray alloc] init];
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        if (keep[i]) {
+            [simplified addObject: locations[i]];
+        }
+    }
+    
+    free(x);
+    free(y);
+    free(keep);
+    free(stack);
+    
+    return simplified;
+}
+
+- (NSDictionary*)encodedSegment {
+    NSArray* points = [self simplifiedLocations];
+    
+    if (points.count == 0) {
+        return nil;
+    }
+    
+    CLLocation* first = points.firstObject;
+    CLLocation* last = points.lastObject;
+    NSTimeInterval start = first.timestamp.timeIntervalSince1970;
+    
+    NSMutableArray* lat = [[NSMutableArray alloc] initWithCapacity: points.count - 1];
+    NSMutableArray* lng = [[NSMutableArray alloc] initWithCapacity: points.count - 1];
+    NSMutableArray* time = [[NSMutableArray alloc] initWithCapacity: points.count - 1];
+    
+    int64_t prevLat = 0, prevLng = 0, prevTime = 0;
+    
+    for (NSUInteger i = 1; i < points.count; i++) {
+        CLLocation* point = points[i];
+        
+        // quantize against the origin, not the previous point, so rounding doesn't accumulate
+        int64_t qLat = llround((point.coordinate.latitude - first.coordinate.latitude) * TRAJECTORY_COORDINATE_SCALE);
+        int64_t qLng = llround((point.coordinate.longitude - first.coordinate.longitude) * TRAJECTORY_COORDINATE_SCALE);
+        int64_t qTime = llround((point.timestamp.timeIntervalSince1970 - start) * TRAJECTORY_TIME_SCALE);
+        
+        [lat addObject: [NSNumber numberWithLongLong: qLat - prevLat]];
+        [lng addObject: [NSNumber numberWithLongLong: qLng - prevLng]];
+        [time addObject: [NSNumber numberWithLongLong: qTime - prevTime]];
+        
+        prevLat = qLat;
+        prevLng = qLng;
+        prevTime = qTime;
+    }
+    
+    return @{ @"lat": [NSNumber numberWithDouble: last.coordinate.latitude],
+              @"lng": [NSNumber numberWithDouble: last.coordinate.longitude],
+              @"path": @{ @"lat": [NSNumber numberWithDouble: first.coordinate.latitude],
+                          @"lng": [NSNumber numberWithDouble: first.coordinate.longitude],
+                          @"time": [NSNumber numberWithDouble: start],
+                          @"scale": [NSNumber numberWithDouble: TRAJECTORY_COORDINATE_SCALE],
+                          @"dlat": lat,
+                          @"dlng": lng,
+                          @"dtime": time,
+                          @"fixes": [NSNumber numberWithUnsignedInteger: _locations.count] } };
+}
+@end